@@ -19,6 +19,12 @@
  * along with HDSave.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/*
+ * A DevInfo is immutable once blkio_open() has returned it, so any number
+ * of threads may call blkio_read() on the same DevInfo concurrently: each
+ * read is positional and does not disturb the others. blkio_close() must
+ * not be called until every other thread has finished with the device.
+ */
 typedef struct DevInfo DevInfo;
 
 extern DevInfo *blkio_open(char *path);
@@ -27,3 +33,38 @@ extern void blkio_describe(DevInfo *dev, char *str, int size);
 extern int blkio_block_size(DevInfo *dev);
 extern uint64_t blkio_total_blocks(DevInfo *dev);
 extern uint64_t blkio_read(DevInfo *dev, void *buf, uint64_t offset, uint64_t count);
+extern void *blkio_map(DevInfo *dev, uint64_t offset, uint64_t count);
+extern void blkio_prefetch(DevInfo *dev, uint64_t offset, uint64_t count);
+extern uint64_t blkio_bad_blocks(DevInfo *dev, uint64_t offset, uint64_t count);
+extern void *blkio_buffer_alloc(DevInfo *dev, int size);
+extern void blkio_buffer_free(DevInfo *dev, void *buf, int size);
+
+/*
+ * Asynchronous reads. Callers fill in buf, offset and count (and arg, for
+ * their own use) and pass batches of requests to blkio_submit(). Finished
+ * requests come back from blkio_reap() in completion order. Each is read
+ * just as blkio_read() would read it, from the mapping, the clone,
+ * readahead or the device, and passed to the each block hook; result is
+ * then count, or -1 if the read failed or came up short, with the error
+ * set as blkio_read() would set it. A queue accepts at most 'depth'
+ * requests in flight and is for use by one thread at a time; use a queue
+ * per thread to read a device from several threads.
+ */
+typedef struct {
+	void *buf;
+	uint64_t offset;
+	uint64_t count;
+	int64_t result;
+	void *arg;
+	uint64_t start;		/* private to the block IO layer */
+	int source;
+} BlkioRequest;
+
+typedef struct BlkioQueue BlkioQueue;
+
+extern BlkioQueue *blkio_queue_open(DevInfo *dev, int depth);
+extern void blkio_queue_close(BlkioQueue *q);
+extern char *blkio_queue_backend(BlkioQueue *q);
+extern int blkio_queue_space(BlkioQueue *q);
+extern int blkio_submit(BlkioQueue *q, BlkioRequest **reqs, int n);
+extern int blkio_reap(BlkioQueue *q, BlkioRequest **done, int min, int max);
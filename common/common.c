@@ -66,7 +66,7 @@ parse_disk_size(char *size)
 	return 0;
 }
 
-static char format_buf[6];
+static char format_buf[16];
 
 char *
 format_disk_size(uint64_t size)
@@ -32,3 +32,5 @@ extern char *get_error(void);
 extern void vwarn(char *fmt, va_list ap);
 
 extern void fatal(char *where, char *fmt, ...);
+
+extern uint64_t clock_ns(void);
@@ -20,6 +20,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 
 #include "port.h"
 #include "common.h"
@@ -107,6 +108,9 @@ disk_open(char *path)
 	 */
 	disk->block_size = 512;
 	disk->blocks_per_cluster = fs_blocks_per_cluster(disk->dev);
+	disk->cache = 0;
+	if (FS_CACHE_SIZE > 0)
+		disk->cache = fs_cache_open(FS_CACHE_SIZE);
 
 	return disk;
 }
@@ -114,6 +118,7 @@ disk_open(char *path)
 void
 disk_close(DiskInfo *disk)
 {
+	fs_cache_close(disk->cache);
 	blkio_close(disk->dev);
 	free(disk);
 }
@@ -158,6 +163,12 @@ fs_open_disk(DiskInfo *disk)
 
 	fs->disk = disk;
 	fs->block_size = disk->block_size;
+	fs->fat = 0;
+	fs->fat_pages = 0;
+	fs->chains = 0;
+	fs->fat_crc_size = -1;
+	fs->fat_crc32_computed = 0;
+	fs->dcache = 0;
 
 	if (!fs_read_super_blocks(fs))
 	{
@@ -165,6 +176,9 @@ fs_open_disk(DiskInfo *disk)
 		return 0;
 	}
 
+	if (FS_DCACHE_SIZE > 0)
+		fs->dcache = fs_dcache_open(FS_DCACHE_SIZE);
+
 	return fs;
 }
 
@@ -175,8 +189,8 @@ fs_close(FSInfo *fs)
 	 * We don't close the disk here as multiple FSInfo instances
 	 * may refer to the same DiskInfo.
 	 */
-	if (fs->fat)
-		free(fs->fat);
+	fs_fat_close(fs);
+	fs_dcache_close(fs->dcache);
 	free(fs);
 }
 
@@ -193,7 +207,7 @@ fs_read_super_blocks(FSInfo *fs)
 		return 0;
 	}
 
-	if (!fs_read(fs, sb_buffer, -1, 0, 2*fs->block_size))
+	if (!fs_read(fs, sb_buffer, -1, 0, 2*fs->block_size, FS_READ_SUPER))
 	{
 		free(sb_buffer);
 		return 0;
@@ -20,12 +20,60 @@
  * along with HDSave.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/*
+ * Size of the metadata cache attached to each disk. Ports short of
+ * memory can set this to 0 in port.h to disable the cache.
+ */
+#ifndef FS_CACHE_SIZE
+#define FS_CACHE_SIZE (16*1024*1024)
+#endif
+
+/*
+ * Size of the pathname lookup and directory index cache attached to
+ * each filesystem.
+ */
+#ifndef FS_DCACHE_SIZE
+#define FS_DCACHE_SIZE (4*1024*1024)
+#endif
+
+typedef struct FSCache FSCache;
+typedef struct FSDcache FSDcache;
+typedef struct FSChainIndex FSChainIndex;
+typedef struct FSFatPages FSFatPages;
+
+typedef struct {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t hit_bytes;
+	uint64_t miss_bytes;
+	uint64_t inserts;
+	uint64_t evictions;
+	uint64_t bytes;
+} FSCacheStats;
+
 typedef struct {
 	DevInfo *dev;
 	int block_size;
 	int blocks_per_cluster;
+	FSCache *cache;
 } DiskInfo;
 
+/*
+ * What a read through fs_read() is for. Everything other than file data
+ * is metadata, and is cached.
+ */
+typedef enum {
+	FS_READ_SUPER,
+	FS_READ_FAT,
+	FS_READ_DIR,
+	FS_READ_DATA,
+} FSReadKind;
+
+/*
+ * An FSInfo may be shared between threads, each using its own
+ * FileHandles. The FAT is loaded by the first file open, so open the
+ * root directory before handing the FSInfo to other threads.
+ */
 typedef struct {
 	DiskInfo *disk;
 	int block_size;
@@ -35,24 +83,45 @@ typedef struct {
 	int used_clusters;
 	int unused_bytes_in_root;
 	int fat_crc32;
-	uint8_t *fat;
+	int fat_crc_size;		/* bytes of FAT covered by the CRC */
+	uint32_t fat_crc32_computed;
+	uint32_t *fat;		/* decoded FAT; see fs_fat.c */
+	FSFatPages *fat_pages;	/* or pages of it, if FS_FAT_PAGED */
+	FSChainIndex *chains;
+	FSDcache *dcache;	/* pathname lookups; see fs_dcache.c */
 } FSInfo;
 
+/*
+ * A run of physically contiguous clusters holding part of a file.
+ * Recordings are usually laid out in a handful of long runs, so a file
+ * is described by a short list of these rather than cluster by cluster.
+ */
 typedef struct {
-	int cluster;
-	int bytes_used;
-} Cluster;
+	int cluster;		/* first cluster of the run */
+	int clusters;		/* number of clusters in the run */
+	uint64_t offset;	/* offset in the file of the run's first byte */
+	uint64_t bytes;		/* bytes of the file held in the run */
+} Extent;
 
 typedef struct {
 	FSInfo *fs;
+	int start_cluster;
+	int is_dir;
 	int buffer_size;
 	char *buffer;
 	int nread;
 	int filesize_needs_fixup;
 	uint64_t filesize;
 	uint64_t offset;
+	int sequential;
+	uint64_t readahead_last;
+	uint64_t readahead_next;
 	int num_clusters;
-	Cluster *clusters;
+	int num_extents;
+	int cur_extent;
+	Extent *extents;
+	mutex_t lock;		/* guards building extent_of */
+	int *extent_of;		/* per cluster position: its extent, for file_pread() */
 } FileHandle;
 
 typedef struct {
@@ -100,21 +169,77 @@ extern void disk_close(DiskInfo *disk);
 extern FSInfo *fs_open_disk(DiskInfo *disk);
 extern void fs_close(FSInfo *fs);
 
+/* fs_cache.c */
+
+extern FSCache *fs_cache_open(int max_bytes);
+extern void fs_cache_close(FSCache *cache);
+extern int fs_cache_lookup(FSCache *cache, void *buf, uint64_t offset, int bytes);
+extern void fs_cache_insert(FSCache *cache, void *buf, uint64_t offset, int bytes);
+extern void fs_cache_get_stats(FSCache *cache, FSCacheStats *stats);
+
+/* fs_dcache.c */
+
+extern FSDcache *fs_dcache_open(int max_bytes);
+extern void fs_dcache_close(FSDcache *dcache);
+extern Extent *fs_dcache_lookup(FSDcache *dcache, int parent, char *name, DirEntry *entry,
+		int *num_extents, int *num_clusters);
+extern void fs_dcache_insert(FSDcache *dcache, int parent, DirEntry *entry, Extent *extents,
+		int num_extents, int num_clusters);
+extern int fs_dcache_dir_find(FSDcache *dcache, int dir, char *name, DirEntry *entry);
+extern void fs_dcache_dir_insert(FSDcache *dcache, int dir, DirEntry *entries, int num_entries);
+
 /* fs_map_w.c */
 
 extern int map_write(FSInfo *fs, char *path);
 
+/* fs_walk.c */
+
+typedef enum {
+	FS_WALK_FILE,
+	FS_WALK_DIR,
+	FS_WALK_DIR_END,
+} FSWalkEvent;
+
+typedef int (*FSWalkFn)(void *arg, FSWalkEvent event, char *path, DirEntry *entry, FileHandle *file);
+
+typedef struct FSOwners FSOwners;
+
+/*
+ * Where a cluster appears in a file.
+ */
+typedef struct {
+	char *path;
+	int position;		/* 0 for the file's first cluster */
+	uint64_t offset;	/* file offset of the cluster's first byte */
+} FSOwner;
+
+extern int fs_walk(FSInfo *fs, FSWalkFn fn, void *arg);
+extern FSOwners *fs_owners_build(FSInfo *fs);
+extern int fs_owners_lookup(FSOwners *owners, int cluster, FSOwner *result, int max);
+extern void fs_owners_close(FSOwners *owners);
+
+/* fs_crc.c */
+
+#define FS_CRC32_INIT 0xffffffff
+
+extern uint32_t fs_crc32(uint32_t crc, void *buf, int bytes);
+
 /* fs_dir.c */
 
 typedef int (*EachDirEntryFn)(FileHandle *dir, void *arg, DirEntry *entry, int index);
 
+extern uint64_t fs_dir_entry_size(FSInfo *fs, DirEntry *entry);
 extern DirEntry *fs_dir_each_entry(FileHandle *dir, EachDirEntryFn fn, void *arg);
-extern DirEntry *fs_dir_find(FileHandle *dir, char *filename);
+extern int fs_dir_find(FileHandle *dir, char *filename, DirEntry *entry);
 
 /* fs_dir_ls.c */
 
 extern int fs_dir_ls(FSInfo *fs, char *path, int opt_long);
 
+/* fs_frag.c */
+
+extern int fs_frag(FSInfo *fs, int all);
+
 /* fs_file.c */
 
 extern FileHandle *file_open_root(FSInfo *fs);
@@ -123,12 +248,67 @@ extern FileHandle *file_open(FileHandle *dir, char *filename);
 extern FileHandle *file_open_pathname(FSInfo *fs, FileHandle *dir, char *pathname);
 extern void file_close(FileHandle *file);
 extern char *file_read(FileHandle *file);
+extern int file_read_buffer(FileHandle *file, char *buf, int swap);
+extern int64_t file_read_into(FileHandle *file, char *buf, uint64_t size, int swap);
+extern int64_t file_pread(FileHandle *file, char *buf, uint64_t offset, uint64_t len);
+extern uint64_t file_next_span(FileHandle *file, uint64_t max, int *cluster, int *cluster_offset);
+extern uint64_t file_bad_blocks(FileHandle *file);
 
 /* fs_fat.c */
 
-extern Cluster *fs_fat_chain(FSInfo *fs, int start_cluster, int *cluster_count, uint64_t filesize) ;
+/*
+ * Problems found in the FAT by fs_fat_check().
+ */
+typedef enum {
+	FS_CHAIN_OK,
+	FS_CHAIN_ENDS_FREE,	/* runs into a free cluster */
+	FS_CHAIN_OUT_OF_RANGE,	/* points past the end of the FAT */
+	FS_CHAIN_LOOP,		/* comes back to one of its own clusters */
+	FS_CHAIN_CROSS_LINKED,	/* runs into a cluster of another chain */
+} FSChainStatus;
+
+typedef struct {
+	FSChainStatus status;
+	int start;		/* first cluster of the chain; -1 for a loop with no way in */
+	int cluster;		/* the cluster whose FAT entry is wrong */
+	int next;		/* what that entry points to */
+	int other;		/* for a cross-link, the start of the other chain */
+} FSChainProblem;
+
+typedef int (*FSChainProblemFn)(void *arg, FSChainProblem *problem);
+
+/*
+ * Free space, from fs_fat_usage(). Bucket i of the histogram counts
+ * free runs of at least 2^i clusters and less than 2^(i+1).
+ */
+#define FS_FREE_RUN_BUCKETS 18
+
+typedef struct {
+	int clusters;		/* clusters on the disk */
+	int free_clusters;
+	int free_runs;
+	int largest_free_run;
+	int free_run_hist[FS_FREE_RUN_BUCKETS];
+	int free_run_clusters[FS_FREE_RUN_BUCKETS];
+} FSFatUsage;
+
+#define fs_fat_crc_ok(fs)	((fs)->fat_crc_size >= 0 && (fs)->fat_crc32_computed == (uint32_t)(fs)->fat_crc32)
+
+extern Extent *fs_fat_chain(FSInfo *fs, int start_cluster, int *cluster_count, uint64_t *filesize, int *extent_count);
+extern void fs_fat_close(FSInfo *fs);
+extern void fs_fat_set_verify(int verify);
+extern int fs_fat_verify(FSInfo *fs);
+extern int fs_fat_check(FSInfo *fs, FSChainProblemFn fn, void *arg);
+extern void fs_fat_describe_problem(FSChainProblem *problem, char *buf, int size);
+extern int fs_fat_usage(FSInfo *fs, FSFatUsage *usage);
+extern uint64_t fs_extents_set_size(FSInfo *fs, Extent *extents, int extent_count, uint64_t filesize);
 
 /* fs_io.c */
 
-extern void *fs_read(FSInfo *fs, void *buf, int cluster, int cluster_offset, int bytes);
+extern void *fs_read(FSInfo *fs, void *buf, int cluster, int cluster_offset, int bytes, FSReadKind kind);
+extern void *fs_read_raw(FSInfo *fs, void *buf, int cluster, int cluster_offset, int bytes);
+extern uint64_t fs_disk_offset(FSInfo *fs, int cluster, int cluster_offset);
+extern void fs_prefetch(FSInfo *fs, int cluster, int cluster_offset, int bytes);
+extern uint64_t fs_bad_blocks(FSInfo *fs, int cluster, int cluster_offset, uint64_t bytes);
 extern void fs_swap_bytes(void *buf, int bytes);
+extern void fs_swap_bytes_copy(void *dst, void *src, int bytes);
@@ -0,0 +1,214 @@
+/*
+ * Cache of recently read filesystem metadata.
+ *
+ * Copyright 2010 Mark H. Wilkinson
+ *
+ * This file is part of HDSave.
+ *
+ * HDSave is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HDSave is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HDSave.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "port.h"
+#include "common.h"
+#include "blkio.h"
+#include "fs.h"
+
+/*
+ * Directory walks read the same directory chunks over and over: 'ls -l'
+ * opens every entry, and every pathname lookup starts again from the
+ * root. This cache keeps the results of recent metadata reads, already
+ * byte swapped, keyed by the device offset they were read from. A read
+ * is a hit if an entry exists at the same offset that is at least as long
+ * as the read; directory reads always start at the same chunk boundaries,
+ * so this is all the generality we need.
+ *
+ * The cache holds at most max_bytes of data and discards the least
+ * recently used entries to make room. File data is never cached; see
+ * fs_read().
+ */
+
+#define FS_CACHE_HASH_SIZE 1024
+
+typedef struct FSCacheEntry {
+	struct FSCacheEntry *hash_next;
+	struct FSCacheEntry *lru_prev;
+	struct FSCacheEntry *lru_next;
+	uint64_t offset;
+	int bytes;
+	char *data;
+} FSCacheEntry;
+
+struct FSCache {
+	mutex_t lock;
+	int max_bytes;
+	int bytes;
+	FSCacheEntry *hash[FS_CACHE_HASH_SIZE];
+	FSCacheEntry lru;
+	FSCacheStats stats;
+};
+
+#define fs_cache_hash(offset) (((offset) >> 9) % FS_CACHE_HASH_SIZE)
+
+FSCache *
+fs_cache_open(int max_bytes)
+{
+	FSCache *cache;
+
+	if ((cache = malloc(sizeof(FSCache))) == 0)
+	{
+		no_memory("fs_cache_open");
+		return 0;
+	}
+
+	memset(cache, 0, sizeof(FSCache));
+	mutex_init(&cache->lock);
+	cache->max_bytes = max_bytes;
+	cache->lru.lru_prev = &cache->lru;
+	cache->lru.lru_next = &cache->lru;
+
+	return cache;
+}
+
+static void
+fs_cache_unlink(FSCache *cache, FSCacheEntry *e)
+{
+	FSCacheEntry **ep;
+
+	for (ep = &cache->hash[fs_cache_hash(e->offset)]; *ep != e; ep = &(*ep)->hash_next)
+		;
+	*ep = e->hash_next;
+	e->lru_prev->lru_next = e->lru_next;
+	e->lru_next->lru_prev = e->lru_prev;
+	cache->bytes -= e->bytes;
+	free(e);
+}
+
+void
+fs_cache_close(FSCache *cache)
+{
+	if (!cache)
+		return;
+
+	while (cache->lru.lru_next != &cache->lru)
+		fs_cache_unlink(cache, cache->lru.lru_next);
+	mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+static FSCacheEntry *
+fs_cache_find(FSCache *cache, uint64_t offset)
+{
+	FSCacheEntry *e;
+
+	for (e = cache->hash[fs_cache_hash(offset)]; e; e = e->hash_next)
+		if (e->offset == offset)
+			return e;
+	return 0;
+}
+
+static void
+fs_cache_make_recent(FSCache *cache, FSCacheEntry *e)
+{
+	e->lru_prev->lru_next = e->lru_next;
+	e->lru_next->lru_prev = e->lru_prev;
+	e->lru_next = cache->lru.lru_next;
+	e->lru_prev = &cache->lru;
+	e->lru_next->lru_prev = e;
+	cache->lru.lru_next = e;
+}
+
+/*
+ * Copy cached data for the read into buf. Returns 1 on a hit, 0 on a miss.
+ */
+int
+fs_cache_lookup(FSCache *cache, void *buf, uint64_t offset, int bytes)
+{
+	FSCacheEntry *e;
+
+	if (!cache)
+		return 0;
+
+	mutex_lock(&cache->lock);
+	if ((e = fs_cache_find(cache, offset)) != 0 && e->bytes >= bytes)
+	{
+		memcpy(buf, e->data, bytes);
+		fs_cache_make_recent(cache, e);
+		cache->stats.hits++;
+		cache->stats.hit_bytes += bytes;
+		mutex_unlock(&cache->lock);
+		return 1;
+	}
+	cache->stats.misses++;
+	cache->stats.miss_bytes += bytes;
+	mutex_unlock(&cache->lock);
+
+	return 0;
+}
+
+void
+fs_cache_insert(FSCache *cache, void *buf, uint64_t offset, int bytes)
+{
+	FSCacheEntry *e;
+	FSCacheEntry *old;
+
+	if (!cache || bytes > cache->max_bytes)
+		return;
+
+	/*
+	 * Allocate before taking the lock. The entry and its data share
+	 * one allocation.
+	 */
+	if ((e = malloc(sizeof(FSCacheEntry)+bytes)) == 0)
+		return;
+	e->offset = offset;
+	e->bytes = bytes;
+	e->data = (char *)(e+1);
+	memcpy(e->data, buf, bytes);
+
+	mutex_lock(&cache->lock);
+	if ((old = fs_cache_find(cache, offset)) != 0)
+		fs_cache_unlink(cache, old);
+	while (cache->bytes+bytes > cache->max_bytes)
+	{
+		fs_cache_unlink(cache, cache->lru.lru_prev);
+		cache->stats.evictions++;
+	}
+	e->hash_next = cache->hash[fs_cache_hash(offset)];
+	cache->hash[fs_cache_hash(offset)] = e;
+	e->lru_prev = &cache->lru;
+	e->lru_next = cache->lru.lru_next;
+	e->lru_next->lru_prev = e;
+	cache->lru.lru_next = e;
+	cache->bytes += bytes;
+	cache->stats.inserts++;
+	mutex_unlock(&cache->lock);
+}
+
+void
+fs_cache_get_stats(FSCache *cache, FSCacheStats *stats)
+{
+	if (!cache)
+	{
+		memset(stats, 0, sizeof(FSCacheStats));
+		return;
+	}
+
+	mutex_lock(&cache->lock);
+	*stats = cache->stats;
+	stats->bytes = cache->bytes;
+	mutex_unlock(&cache->lock);
+}
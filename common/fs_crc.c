@@ -0,0 +1,271 @@
+/*
+ * CRC32 as used for the FAT checksum in a Topfield superblock.
+ *
+ * Copyright 2010 Mark H. Wilkinson
+ *
+ * This file is part of HDSave.
+ *
+ * HDSave is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HDSave is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HDSave.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "port.h"
+#include "common.h"
+#include "blkio.h"
+#include "fs.h"
+
+/*
+ * The Toppy's CRC is the big endian form of the usual CRC32: polynomial
+ * 0x04c11db7, most significant bit first, no bit reflection and no final
+ * inversion (CRC-32/MPEG-2). Start with FS_CRC32_INIT, and feed the
+ * result of one call into the next to checksum a buffer in pieces.
+ *
+ * The portable version is slicing-by-8: eight tables of 256 entries let
+ * it take eight bytes per step. On x86 with PCLMULQDQ the data is folded
+ * 16 bytes at a time with carry-less multiplies, and ARMv8 builds with
+ * the CRC extension use its instructions, which compute the bit reflected
+ * CRC, on bit reversed data. Everything shorter than a step goes through
+ * the tables.
+ *
+ * The tables are built by the first call, which comes from loading the
+ * FAT before any other threads get going.
+ */
+
+#define FS_CRC32_POLY 0x04c11db7
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FS_CRC_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_FEATURE_CRC32)
+#define FS_CRC_ARMV8
+#include <arm_acle.h>
+#endif
+
+typedef uint32_t (*CrcFn)(uint32_t crc, uint8_t *p, int bytes);
+
+static uint32_t crc_table[8][256];
+
+static void
+fs_crc_init_tables(void)
+{
+	uint32_t crc;
+	int i;
+	int j;
+
+	for (i = 0; i < 256; i++)
+	{
+		crc = (uint32_t)i << 24;
+		for (j = 0; j < 8; j++)
+			crc = (crc << 1) ^ ((crc & 0x80000000)? FS_CRC32_POLY : 0);
+		crc_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc_table[j][i] = (crc_table[j-1][i] << 8) ^ crc_table[0][crc_table[j-1][i] >> 24];
+}
+
+static uint32_t
+fs_crc_slice8(uint32_t crc, uint8_t *p, int bytes)
+{
+	for (; bytes >= 8; p += 8, bytes -= 8)
+	{
+		crc ^= (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+		crc = crc_table[7][crc >> 24] ^ crc_table[6][(crc >> 16) & 0xff]
+			^ crc_table[5][(crc >> 8) & 0xff] ^ crc_table[4][crc & 0xff]
+			^ crc_table[3][p[4]] ^ crc_table[2][p[5]]
+			^ crc_table[1][p[6]] ^ crc_table[0][p[7]];
+	}
+	for (; bytes > 0; p++, bytes--)
+		crc = (crc << 8) ^ crc_table[0][(crc >> 24) ^ *p];
+	return crc;
+}
+
+#ifdef FS_CRC_X86
+
+/*
+ * Reversing each 16 byte block puts the first bit of the message in bit
+ * 127, so bit i holds the coefficient of x^i. Moving the running value
+ * on past the next block multiplies it by x^128; the high and low halves
+ * are multiplied by x^192 and x^128 mod P instead, which leaves a value
+ * with the same remainder that fits in 128 bits again. Whatever is left
+ * at the end is reduced by treating it as a 16 byte message of its own.
+ */
+#define FS_CRC_X192 0xc5b9cd4c		/* x^192 mod P */
+#define FS_CRC_X128 0xe8a45605		/* x^128 mod P */
+
+__attribute__((target("pclmul,ssse3")))
+static uint32_t
+fs_crc_pclmul(uint32_t crc, uint8_t *p, int bytes)
+{
+	__m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i k = _mm_set_epi64x(FS_CRC_X192, FS_CRC_X128);
+	__m128i a;
+	__m128i b;
+	uint8_t rest[16];
+
+	if (bytes < 32)
+		return fs_crc_slice8(crc, p, bytes);
+
+	/* The initial value is added to the first 32 bits of the message. */
+	a = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)p), reverse);
+	a = _mm_xor_si128(a, _mm_set_epi32(crc, 0, 0, 0));
+	for (p += 16, bytes -= 16; bytes >= 16; p += 16, bytes -= 16)
+	{
+		b = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)p), reverse);
+		a = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(a, k, 0x11),
+				_mm_clmulepi64_si128(a, k, 0x00)), b);
+	}
+
+	_mm_storeu_si128((__m128i *)rest, _mm_shuffle_epi8(a, reverse));
+	crc = fs_crc_slice8(0, rest, sizeof(rest));
+	return fs_crc_slice8(crc, p, bytes);
+}
+
+#endif
+
+#ifdef FS_CRC_ARMV8
+
+/*
+ * The reflected CRC of bit reversed bytes, from a bit reversed initial
+ * value, is the bit reversal of the CRC we want.
+ */
+static uint32_t
+fs_crc_armv8(uint32_t crc, uint8_t *p, int bytes)
+{
+	uint64_t v;
+
+	crc = __rbit(crc);
+	for (; bytes >= 8; p += 8, bytes -= 8)
+	{
+		memcpy(&v, p, sizeof(v));
+		crc = __crc32d(crc, __builtin_bswap64(__rbitll(v)));
+	}
+	for (; bytes > 0; p++, bytes--)
+		crc = __crc32b(crc, __rbit(*p) >> 24);
+	return __rbit(crc);
+}
+
+#endif
+
+static CrcFn
+fs_crc_choose(void)
+{
+	fs_crc_init_tables();
+#ifdef FS_CRC_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3"))
+		return fs_crc_pclmul;
+#endif
+#ifdef FS_CRC_ARMV8
+	return fs_crc_armv8;
+#endif
+	return fs_crc_slice8;
+}
+
+static uint32_t fs_crc_first(uint32_t crc, uint8_t *p, int bytes);
+
+static CrcFn fs_crc = fs_crc_first;
+
+static uint32_t
+fs_crc_first(uint32_t crc, uint8_t *p, int bytes)
+{
+	fs_crc = fs_crc_choose();
+	return fs_crc(crc, p, bytes);
+}
+
+uint32_t
+fs_crc32(uint32_t crc, void *buf, int bytes)
+{
+	return fs_crc(crc, (uint8_t *)buf, bytes);
+}
+
+#ifdef TEST
+
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_BYTES (768*512)
+#define BENCH_ROUNDS 200
+
+static uint32_t
+fs_crc_bitwise(uint32_t crc, uint8_t *p, int bytes)
+{
+	int j;
+
+	for (; bytes > 0; p++, bytes--)
+	{
+		crc ^= (uint32_t)*p << 24;
+		for (j = 0; j < 8; j++)
+			crc = (crc << 1) ^ ((crc & 0x80000000)? FS_CRC32_POLY : 0);
+	}
+	return crc;
+}
+
+static void
+bench(char *name, CrcFn fn, uint8_t *buf)
+{
+	clock_t start;
+	double secs;
+	uint32_t crc = 0;
+	int i;
+
+	if (fn(FS_CRC32_INIT, (uint8_t *)"123456789", 9) != 0x0376e6e7)
+	{
+		printf("%-8s FAILED check value\n", name);
+		return;
+	}
+	/* Every length and alignment over a few blocks. */
+	for (i = 0; i < 200; i++)
+		if (fn(0x12345678, buf+i%16, i) != fs_crc_bitwise(0x12345678, buf+i%16, i))
+		{
+			printf("%-8s FAILED at %d bytes\n", name, i);
+			return;
+		}
+
+	start = clock();
+	for (i = 0; i < BENCH_ROUNDS; i++)
+		crc = fn(FS_CRC32_INIT, buf, BENCH_BYTES);
+	secs = (double)(clock()-start)/CLOCKS_PER_SEC;
+	printf("%-8s %8.2f GB/s, %6.1f us per FAT (%08" PRIx32 ")\n", name,
+			(double)BENCH_BYTES*BENCH_ROUNDS/secs/1e9, secs/BENCH_ROUNDS*1e6, crc);
+}
+
+int
+main(void)
+{
+	uint8_t *buf = malloc(BENCH_BYTES);
+	int i;
+
+	fs_crc_init_tables();
+	for (i = 0; i < BENCH_BYTES; i++)
+		buf[i] = i*7+(i>>9);
+
+	bench("bitwise", fs_crc_bitwise, buf);
+	bench("slice8", fs_crc_slice8, buf);
+#ifdef FS_CRC_X86
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3"))
+		bench("pclmul", fs_crc_pclmul, buf);
+#endif
+#ifdef FS_CRC_ARMV8
+	bench("armv8", fs_crc_armv8, buf);
+#endif
+	bench("chosen", fs_crc_choose(), buf);
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,321 @@
+/*
+ * Cache of pathname lookups and directory indexes.
+ *
+ * Copyright 2010 Mark H. Wilkinson
+ *
+ * This file is part of HDSave.
+ *
+ * HDSave is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HDSave is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HDSave.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "port.h"
+#include "common.h"
+#include "blkio.h"
+#include "fs.h"
+
+/*
+ * Opening /DataFiles/x.rec means following the root's FAT chain,
+ * scanning the root for DataFiles, following its chain and scanning it
+ * in turn; a script copying a folder does all that again for every file
+ * in it. This cache remembers what each step found: the directory entry
+ * for a name in the directory starting at a given cluster, and the
+ * extents of the entry's chain. A lookup in a directory we've already
+ * been through then needs no reads at all. We never write to the disk,
+ * so nothing in here goes stale.
+ *
+ * The root is kept under parent -1 and name "/". Like the metadata cache
+ * this holds at most max_bytes and discards the least recently used
+ * entries to make room.
+ *
+ * The cache also keeps an index of each directory fs_dir_find() has read
+ * through: a copy of its entries, and an open addressing hash table of
+ * their names, whose slots hold entry numbers. Linear probing in a table
+ * at most half full finds a name in a probe or two, so big DataFiles
+ * folders are no slower to search than small ones, and the directory
+ * isn't read again.
+ */
+
+#define FS_DCACHE_HASH_SIZE 1024
+
+typedef struct FSDcacheEntry {
+	struct FSDcacheEntry *hash_next;
+	struct FSDcacheEntry *lru_prev;
+	struct FSDcacheEntry *lru_next;
+	int is_index;
+	int parent;		/* directory cluster, or -1 for the root itself */
+	int bytes;
+	/* A lookup: what name found in parent. */
+	DirEntry entry;
+	int num_clusters;
+	int num_extents;
+	Extent *extents;
+	/* An index of the directory starting at parent. */
+	int num_entries;
+	DirEntry *entries;
+	int mask;		/* slots in the hash table, less one */
+	int *slots;		/* entry number+1, or 0 if empty */
+} FSDcacheEntry;
+
+struct FSDcache {
+	mutex_t lock;
+	int max_bytes;
+	int bytes;
+	FSDcacheEntry *hash[FS_DCACHE_HASH_SIZE];
+	FSDcacheEntry lru;
+};
+
+static unsigned int
+fs_dcache_name_hash(unsigned int h, char *name)
+{
+	while (*name)
+		h = h*31 + (unsigned char)*name++;
+	return h;
+}
+
+#define fs_dcache_hash(parent, name) (fs_dcache_name_hash((parent), (name)) % FS_DCACHE_HASH_SIZE)
+
+FSDcache *
+fs_dcache_open(int max_bytes)
+{
+	FSDcache *dcache;
+
+	if ((dcache = malloc(sizeof(FSDcache))) == 0)
+	{
+		no_memory("fs_dcache_open");
+		return 0;
+	}
+
+	memset(dcache, 0, sizeof(FSDcache));
+	mutex_init(&dcache->lock);
+	dcache->max_bytes = max_bytes;
+	dcache->lru.lru_prev = &dcache->lru;
+	dcache->lru.lru_next = &dcache->lru;
+
+	return dcache;
+}
+
+static void
+fs_dcache_unlink(FSDcache *dcache, FSDcacheEntry *e)
+{
+	FSDcacheEntry **ep;
+
+	for (ep = &dcache->hash[fs_dcache_hash(e->parent, e->is_index? "" : e->entry.filename)];
+			*ep != e; ep = &(*ep)->hash_next)
+		;
+	*ep = e->hash_next;
+	e->lru_prev->lru_next = e->lru_next;
+	e->lru_next->lru_prev = e->lru_prev;
+	dcache->bytes -= e->bytes;
+	free(e);
+}
+
+void
+fs_dcache_close(FSDcache *dcache)
+{
+	if (!dcache)
+		return;
+
+	while (dcache->lru.lru_next != &dcache->lru)
+		fs_dcache_unlink(dcache, dcache->lru.lru_next);
+	mutex_destroy(&dcache->lock);
+	free(dcache);
+}
+
+/*
+ * Find the lookup of name in parent or, if name is 0, parent's index.
+ */
+static FSDcacheEntry *
+fs_dcache_find(FSDcache *dcache, int parent, char *name)
+{
+	FSDcacheEntry *e;
+
+	for (e = dcache->hash[fs_dcache_hash(parent, name? name : "")]; e; e = e->hash_next)
+		if (e->parent == parent && e->is_index == !name
+				&& (!name || strcmp(e->entry.filename, name) == 0))
+			return e;
+	return 0;
+}
+
+static void
+fs_dcache_make_recent(FSDcache *dcache, FSDcacheEntry *e)
+{
+	e->lru_prev->lru_next = e->lru_next;
+	e->lru_next->lru_prev = e->lru_prev;
+	e->lru_next = dcache->lru.lru_next;
+	e->lru_prev = &dcache->lru;
+	e->lru_next->lru_prev = e;
+	dcache->lru.lru_next = e;
+}
+
+/*
+ * Add a new entry, replacing any with the same key.
+ */
+static void
+fs_dcache_add(FSDcache *dcache, FSDcacheEntry *e)
+{
+	FSDcacheEntry *old;
+	char *name = e->is_index? 0 : e->entry.filename;
+	unsigned int h = fs_dcache_hash(e->parent, name? name : "");
+
+	mutex_lock(&dcache->lock);
+	if ((old = fs_dcache_find(dcache, e->parent, name)) != 0)
+		fs_dcache_unlink(dcache, old);
+	while (dcache->bytes+e->bytes > dcache->max_bytes)
+		fs_dcache_unlink(dcache, dcache->lru.lru_prev);
+	e->hash_next = dcache->hash[h];
+	dcache->hash[h] = e;
+	e->lru_prev = &dcache->lru;
+	e->lru_next = dcache->lru.lru_next;
+	e->lru_next->lru_prev = e;
+	dcache->lru.lru_next = e;
+	dcache->bytes += e->bytes;
+	mutex_unlock(&dcache->lock);
+}
+
+/*
+ * Look up name in the directory starting at cluster parent. On a hit,
+ * copy its directory entry into entry and return a malloc'd copy of its
+ * extents, for the caller to free. Returns 0 on a miss.
+ */
+Extent *
+fs_dcache_lookup(FSDcache *dcache, int parent, char *name, DirEntry *entry,
+		int *num_extents, int *num_clusters)
+{
+	FSDcacheEntry *e;
+	Extent *extents = 0;
+
+	if (!dcache)
+		return 0;
+
+	mutex_lock(&dcache->lock);
+	if ((e = fs_dcache_find(dcache, parent, name)) != 0
+			&& (extents = malloc(e->num_extents*sizeof(Extent))) != 0)
+	{
+		memcpy(extents, e->extents, e->num_extents*sizeof(Extent));
+		*entry = e->entry;
+		*num_extents = e->num_extents;
+		*num_clusters = e->num_clusters;
+		fs_dcache_make_recent(dcache, e);
+	}
+	mutex_unlock(&dcache->lock);
+
+	return extents;
+}
+
+void
+fs_dcache_insert(FSDcache *dcache, int parent, DirEntry *entry, Extent *extents,
+		int num_extents, int num_clusters)
+{
+	FSDcacheEntry *e;
+	int bytes = sizeof(FSDcacheEntry) + num_extents*sizeof(Extent);
+
+	if (!dcache || bytes > dcache->max_bytes)
+		return;
+
+	/*
+	 * Allocate before taking the lock. The entry and its extents
+	 * share one allocation.
+	 */
+	if ((e = calloc(1, bytes)) == 0)
+		return;
+	e->parent = parent;
+	e->bytes = bytes;
+	e->entry = *entry;
+	e->num_clusters = num_clusters;
+	e->num_extents = num_extents;
+	e->extents = (Extent *)(e+1);
+	memcpy(e->extents, extents, num_extents*sizeof(Extent));
+
+	fs_dcache_add(dcache, e);
+}
+
+/*
+ * Look name up in the index of the directory starting at cluster dir,
+ * copying its entry into entry. Returns 1 if it's there, 0 if it isn't,
+ * or -1 if the directory hasn't been indexed.
+ */
+int
+fs_dcache_dir_find(FSDcache *dcache, int dir, char *name, DirEntry *entry)
+{
+	FSDcacheEntry *e;
+	unsigned int h;
+	int slot;
+	int r = 0;
+
+	if (!dcache)
+		return -1;
+
+	mutex_lock(&dcache->lock);
+	if ((e = fs_dcache_find(dcache, dir, 0)) == 0)
+	{
+		mutex_unlock(&dcache->lock);
+		return -1;
+	}
+	for (h = fs_dcache_name_hash(0, name); (slot = e->slots[h & e->mask]) != 0; h++)
+		if (strcmp(e->entries[slot-1].filename, name) == 0)
+		{
+			*entry = e->entries[slot-1];
+			r = 1;
+			break;
+		}
+	fs_dcache_make_recent(dcache, e);
+	mutex_unlock(&dcache->lock);
+
+	return r;
+}
+
+/*
+ * Index the directory starting at cluster dir, given all its entries in
+ * order. Where names repeat, the first wins, as it would in a scan.
+ */
+void
+fs_dcache_dir_insert(FSDcache *dcache, int dir, DirEntry *entries, int num_entries)
+{
+	FSDcacheEntry *e;
+	int num_slots = 16;
+	int bytes;
+	unsigned int h;
+	int slot;
+	int i;
+
+	if (!dcache)
+		return;
+	while (num_slots < 2*num_entries)
+		num_slots *= 2;
+	bytes = sizeof(FSDcacheEntry) + num_entries*sizeof(DirEntry) + num_slots*sizeof(int);
+	if (bytes > dcache->max_bytes || (e = calloc(1, bytes)) == 0)
+		return;
+
+	e->is_index = 1;
+	e->parent = dir;
+	e->bytes = bytes;
+	e->num_entries = num_entries;
+	e->entries = (DirEntry *)(e+1);
+	memcpy(e->entries, entries, num_entries*sizeof(DirEntry));
+	e->mask = num_slots-1;
+	e->slots = (int *)(e->entries+num_entries);
+	for (i = 0; i < num_entries; i++)
+	{
+		for (h = fs_dcache_name_hash(0, entries[i].filename); (slot = e->slots[h & e->mask]) != 0; h++)
+			if (strcmp(e->entries[slot-1].filename, entries[i].filename) == 0)
+				break;
+		if (!slot)
+			e->slots[h & e->mask] = i+1;
+	}
+
+	fs_dcache_add(dcache, e);
+}
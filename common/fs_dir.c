@@ -27,6 +27,21 @@
 #include "blkio.h"
 #include "fs.h"
 
+/*
+ * The size of a file as its directory entry records it. Files saved with
+ * a sector CRC also give the bytes used in their last block. Only '.'
+ * entries hold the size of a directory.
+ */
+uint64_t
+fs_dir_entry_size(FSInfo *fs, DirEntry *entry)
+{
+	int unused = be32toh(entry->unused_bytes_in_last_cluster);
+
+	if (entry->s3_crc)
+		unused = unused+512-be16toh(entry->bytes_in_last_block);
+	return (uint64_t)be32toh(entry->clusters)*fs->bytes_per_cluster - unused;
+}
+
 DirEntry *
 fs_dir_each_entry(FileHandle *dir, EachDirEntryFn fn, void *arg)
 {
@@ -51,8 +66,85 @@ fs_dir_entry_filename_match(FileHandle *dir, void *filename, DirEntry *entry, in
 		return 1;
 }
 
-DirEntry *
-fs_dir_find(FileHandle *dir, char *filename)
+typedef struct {
+	DirEntry *entries;
+	int num_entries;
+	int max_entries;
+} DirIndex;
+
+static int
+fs_dir_entry_collect(FileHandle *dir, void *arg, DirEntry *entry, int index)
 {
-	fs_dir_each_entry(dir, fs_dir_entry_filename_match, filename);
+	DirIndex *ix = (DirIndex *)arg;
+	DirEntry *p;
+
+	if (entry->type == DIR_ENTRY_UNUSED)
+		return 1;
+	if (ix->num_entries == ix->max_entries)
+	{
+		ix->max_entries = ix->max_entries? 2*ix->max_entries : 256;
+		if ((p = realloc(ix->entries, ix->max_entries*sizeof(DirEntry))) == 0)
+		{
+			no_memory("fs_dir_find");
+			return 0;
+		}
+		ix->entries = p;
+	}
+	ix->entries[ix->num_entries++] = *entry;
+	return 1;
+}
+
+/*
+ * Read the whole of dir, add its index to the cache and look for
+ * filename in it.
+ */
+static int
+fs_dir_index(FileHandle *dir, char *filename, DirEntry *entry)
+{
+	DirIndex ix;
+	int r = 0;
+	int i;
+
+	memset(&ix, 0, sizeof(ix));
+	if (fs_dir_each_entry(dir, fs_dir_entry_collect, &ix) != 0 || dir->offset < dir->filesize)
+	{
+		free(ix.entries);
+		return 0;
+	}
+
+	fs_dcache_dir_insert(dir->fs->dcache, dir->start_cluster, ix.entries, ix.num_entries);
+	for (i = 0; i < ix.num_entries; i++)
+		if (strcmp(filename, ix.entries[i].filename) == 0)
+		{
+			*entry = ix.entries[i];
+			r = 1;
+			break;
+		}
+	free(ix.entries);
+	return r;
+}
+
+/*
+ * Find filename in dir, copying its entry into entry. Returns 1 if it's
+ * there, 0 if it isn't or the directory can't be read. The first search
+ * of a directory reads all of it and leaves an index in the filesystem's
+ * cache, which answers every later search without reading it again.
+ * Without a cache, or if dir has already been partly read, it is scanned
+ * from where it is up to.
+ */
+int
+fs_dir_find(FileHandle *dir, char *filename, DirEntry *entry)
+{
+	DirEntry *found;
+	int r;
+
+	if ((r = fs_dcache_dir_find(dir->fs->dcache, dir->start_cluster, filename, entry)) >= 0)
+		return r;
+	if (dir->fs->dcache && dir->offset == 0)
+		return fs_dir_index(dir, filename, entry);
+
+	if ((found = fs_dir_each_entry(dir, fs_dir_entry_filename_match, filename)) == 0)
+		return 0;
+	*entry = *found;
+	return 1;
 }
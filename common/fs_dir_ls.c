@@ -20,6 +20,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 
 #include "port.h"
 #include "common.h"
@@ -28,77 +29,168 @@
 
 #include "fs_int.h"
 
-int
-fs_dir_ls(FSInfo *fs, char *path, int opt_long)
+typedef struct {
+	DirEntry entry;
+	int is_dir;
+	uint64_t size;
+} LsEntry;
+
+typedef struct {
+	FSInfo *fs;
+	int opt_long;
+	LsEntry *entries;
+	int num_entries;
+	int max_entries;
+	int num_subdirs;
+} Ls;
+
+static int
+fs_dir_ls_entry(FileHandle *dir, void *arg, DirEntry *dir_entry, int index)
 {
-	FileHandle *dir;
-	FileHandle *entry;
-	DirEntry *dir_entry;
-	int i;
+	Ls *ls = (Ls *)arg;
+	LsEntry *p;
+	int is_dir = 1;
 
-	if ((dir = file_open_pathname(fs, 0, path)) == 0)
+	switch (dir_entry->type)
+	{
+	case DIR_ENTRY_UNUSED:
+	case DIR_ENTRY_DOT_DOT:
+	case DIR_ENTRY_DOT:
+		return 1;
+	case DIR_ENTRY_FILEA:
+	case DIR_ENTRY_FILET:
+		is_dir = 0;
+		break;
+	case DIR_ENTRY_SUBDIR:
+	case DIR_ENTRY_RECYCLE:
+		break;
+	default:
+		fs_error("unrecognised directory entry type %d", dir_entry->type);
 		return 0;
+	}
 
-	while (file_read(dir) > 0)
+	if (!ls->opt_long)
 	{
-		dir_entry = (DirEntry *)dir->buffer;
-
-		while (dir_entry < (DirEntry *)(dir->buffer+dir->nread)) {
-		        int is_dir = 1;
-
-			switch (dir_entry->type)
-			{
-			case DIR_ENTRY_UNUSED:
-			case DIR_ENTRY_DOT_DOT:
-			case DIR_ENTRY_DOT:
-				break;
-			case DIR_ENTRY_FILEA:
-			case DIR_ENTRY_FILET:
-			        is_dir = 0;
-			        /* fall through */
-			case DIR_ENTRY_SUBDIR:
-			case DIR_ENTRY_RECYCLE:
-			        if (!opt_long)
-			        {
-					printf("%s%s\n", dir_entry->filename, is_dir? "/" : "");
-					break;
-				}
-
-				if ((entry = file_open_dir_entry(dir, dir_entry)) == 0)
-				{
-					file_close(dir);
-					return 0;
-				}
-
-				/*
-				 * Read the first bit of the file if it needs
-				 * the file size fixing up.
-				 */
-				if (entry->filesize_needs_fixup)
-				{
-					if (!file_read(entry))
-					{
-						file_close(entry);
-						file_close(dir);
-						return 0;
-					}
-				}
-
-				printf("%s %10s %s\n", is_dir? "d" : "-",
-						format_disk_size(entry->filesize),
-						dir_entry->filename);
-
-				file_close(entry);
-				break;
-			default:
-				fs_error("unrecognised directory entry type %d", dir_entry->type);
-				file_close(dir);
-				return 0;
-			}
-			dir_entry++;
+		printf("%s%s\n", dir_entry->filename, is_dir? "/" : "");
+		return 1;
+	}
+
+	if (ls->num_entries == ls->max_entries)
+	{
+		ls->max_entries = ls->max_entries? 2*ls->max_entries : 256;
+		if ((p = realloc(ls->entries, ls->max_entries*sizeof(LsEntry))) == 0)
+		{
+			no_memory("fs_dir_ls");
+			return 0;
 		}
+		ls->entries = p;
 	}
+	p = &ls->entries[ls->num_entries++];
+	p->entry = *dir_entry;
+	p->is_dir = is_dir;
 
-	file_close(dir);
+	/*
+	 * A subdirectory's entry doesn't give its size: that comes from
+	 * the '.' entry at the start of the subdirectory, which is read
+	 * later. Until then it is taken to fill its first cluster, as
+	 * file_open_dir_entry() does.
+	 */
+	if (is_dir)
+	{
+		p->size = ls->fs->bytes_per_cluster;
+		ls->num_subdirs++;
+	}
+	else
+	{
+		p->size = fs_dir_entry_size(ls->fs, dir_entry);
+	}
 	return 1;
 }
+
+static int
+fs_dir_ls_by_cluster(const void *a, const void *b)
+{
+	uint32_t ca = be32toh((*(LsEntry **)a)->entry.start_cluster);
+	uint32_t cb = be32toh((*(LsEntry **)b)->entry.start_cluster);
+
+	return ca < cb? -1 : ca > cb;
+}
+
+/*
+ * Size the subdirectories from their '.' entries. That's a block read
+ * from each, so read them in order of cluster to keep the seeks short
+ * and in one direction.
+ */
+static int
+fs_dir_ls_fixup(Ls *ls)
+{
+	FSInfo *fs = ls->fs;
+	LsEntry **subdirs;
+	DirEntry *dot;
+	char *block;
+	int n = 0;
+	int i;
+
+	if (ls->num_subdirs == 0)
+		return 1;
+	if ((subdirs = malloc(ls->num_subdirs*sizeof(LsEntry *))) == 0)
+	{
+		no_memory("fs_dir_ls");
+		return 0;
+	}
+	if ((block = blkio_buffer_alloc(fs->disk->dev, fs->block_size)) == 0)
+	{
+		no_memory("fs_dir_ls");
+		free(subdirs);
+		return 0;
+	}
+
+	for (i = 0; i < ls->num_entries; i++)
+		if (ls->entries[i].is_dir)
+			subdirs[n++] = &ls->entries[i];
+	qsort(subdirs, n, sizeof(LsEntry *), fs_dir_ls_by_cluster);
+
+	for (i = 0; i < n; i++)
+	{
+		if (!fs_read(fs, block, be32toh(subdirs[i]->entry.start_cluster), 0,
+				fs->block_size, FS_READ_DIR))
+			break;
+		dot = (DirEntry *)block;
+		if (dot->type == DIR_ENTRY_DOT)
+			subdirs[i]->size = fs_dir_entry_size(fs, dot);
+	}
+
+	blkio_buffer_free(fs->disk->dev, block, fs->block_size);
+	free(subdirs);
+	return i == n;
+}
+
+/*
+ * List a directory. A long listing takes every size from the directory
+ * entries rather than opening each file, so it costs a read of the
+ * directory plus one block for each subdirectory.
+ */
+int
+fs_dir_ls(FSInfo *fs, char *path, int opt_long)
+{
+	FileHandle *dir;
+	LsEntry *p;
+	Ls ls;
+	int r;
+
+	if ((dir = file_open_pathname(fs, 0, path)) == 0)
+		return 0;
+
+	memset(&ls, 0, sizeof(ls));
+	ls.fs = fs;
+	ls.opt_long = opt_long;
+	r = fs_dir_each_entry(dir, fs_dir_ls_entry, &ls) == 0 && fs_dir_ls_fixup(&ls);
+	file_close(dir);
+
+	for (p = ls.entries; r && p < ls.entries+ls.num_entries; p++)
+		printf("%s %10s %s\n", p->is_dir? "d" : "-",
+				format_disk_size(p->size), p->entry.filename);
+
+	free(ls.entries);
+	return r;
+}
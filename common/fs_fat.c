@@ -20,6 +20,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <sys/param.h>
 
 #include "port.h"
@@ -27,14 +28,6 @@
 #include "blkio.h"
 #include "fs.h"
 
-typedef union {
-	struct {
-		uint8_t zero;
-		uint8_t bytes[3];
-	} raw;
-	uint32_t value;
-} FATEntry;
-
 #define FAT_FREE         0xffffff
 #define FAT_CHAIN_END    0xfffffe
 #define FAT_CLUSTER_MASK 0x01ffff
@@ -43,80 +36,313 @@ typedef union {
 #define FAT_CLUSTER_IS_MARKED(value) ((value&0x800000)? ((value&0x7e0000)^0x7e0000) : (value&0x7e0000))
 #define FAT_CLUSTER_UNMARKED(value) ((value&0x800000)? (value|0x7e0000) : (value&0x01ffff))
 
+/*
+ * The FAT is 768 blocks of 3 byte entries. On disk each entry is a 24-bit
+ * big endian number, with the mark bits folded into it as above. Chain
+ * walks visit every entry of every file, so the FAT is decoded once, as
+ * it's loaded, into a table of native words: the low 24 bits hold the
+ * unmarked entry and the top bit says whether it was marked.
+ */
+#define FAT_BYTES(fs)      (768*(fs)->block_size)
+#define FAT_ENTRIES(fs)    (FAT_BYTES(fs)/3)
+#define FAT_TABLE_MARKED   0x80000000
+#define FAT_TABLE_VALUE    0x00ffffff
+
+/*
+ * What a paged FAT returns for an entry it couldn't read: more than 24
+ * bits, so no entry on the disk can be mistaken for it.
+ */
+#define FAT_UNREADABLE     0x01000000
+
+/*
+ * The decoded table takes 512K. Ports that can't spare that set
+ * FS_FAT_PAGED to 1 in port.h, and the FAT is instead read on demand a
+ * page at a time into FS_FAT_PAGES page buffers, the least recently used
+ * page making way for the next. A page is three blocks, which is exactly
+ * 512 entries, so entries never straddle pages. The paged FAT isn't
+ * thread safe; it's meant for the TAP.
+ */
+#ifndef FS_FAT_PAGED
+#define FS_FAT_PAGED 0
+#endif
+
+#ifndef FS_FAT_PAGES
+#define FS_FAT_PAGES 4
+#endif
+
+#define FAT_PAGE_ENTRIES   512
+#define FAT_PAGE_BYTES     (FAT_PAGE_ENTRIES*3)
+
+typedef struct {
+	int page;		/* page held, or -1 */
+	unsigned last_used;
+	uint8_t raw[FAT_PAGE_BYTES];
+} FatPage;
+
+struct FSFatPages {
+	unsigned clock;
+	int crc_done;
+	FatPage pages[FS_FAT_PAGES];
+};
+
+/*
+ * Ports short of memory can set this to 0 in port.h to do without the
+ * chain index described below.
+ */
+#ifndef FS_FAT_INDEX
+#define FS_FAT_INDEX 1
+#endif
+
+static FSChainIndex *fs_fat_index_build(FSInfo *fs);
+
+static int fs_fat_verify_on_load = 0;
+
+/*
+ * Decode n raw entries. Written without branches so the compiler can
+ * vectorise it.
+ */
+static void
+fs_fat_decode(uint32_t *table, uint8_t *raw, int n)
+{
+	uint32_t value;
+	uint32_t high;
+	uint32_t marked;
+	int i;
+
+	for (i = 0; i < n; i++, raw += 3)
+	{
+		value = raw[0] << 16 | raw[1] << 8 | raw[2];
+		high = -(value >> 23);		/* all ones if bit 23 is set */
+		marked = (value & 0x7e0000) ^ (high & 0x7e0000);
+		table[i] = (high & (value | 0x7e0000)) | (~high & (value & FAT_CLUSTER_MASK))
+				| (uint32_t)(marked != 0) << 31;
+	}
+}
+
+/*
+ * The superblock holds a CRC of the in-use part of the FAT: the entries
+ * for used_clusters clusters, rounded up to a whole block. It's always
+ * computed as the FAT is loaded, which costs a fraction of a millisecond,
+ * but only checked if asked for, as tfhd fsck does. A paged FAT is only
+ * read in full to compute the CRC when it is to be checked.
+ */
+void
+fs_fat_set_verify(int verify)
+{
+	fs_fat_verify_on_load = verify;
+}
+
+static int
+fs_fat_crc_size(FSInfo *fs, int fat_size)
+{
+	int64_t bytes = (int64_t)fs->used_clusters*3;
+
+	bytes = (bytes+fs->block_size-1)/fs->block_size*fs->block_size;
+	if (bytes < 0 || bytes > fat_size)
+		return -1;
+	return bytes;
+}
+
+static int
+fs_fat_crc_mismatch(FSInfo *fs)
+{
+	if (fs->fat_crc_size < 0)
+		fs_error("superblock claims %d used clusters, more than the FAT holds", fs->used_clusters);
+	else
+		fs_error("FAT CRC is 0x%08" PRIx32 ", superblock says 0x%08" PRIx32,
+				fs->fat_crc32_computed, (uint32_t)fs->fat_crc32);
+	return 0;
+}
+
+#if FS_FAT_PAGED
+
+#define fs_fat_loaded(fs)	((fs)->fat_pages != 0)
+#define fs_fat_entry(fs, cluster)	(fs_fat_paged_entry(fs, cluster) & (FAT_TABLE_VALUE|FAT_UNREADABLE))
+#define fs_fat_entry_marked(fs, cluster)	(fs_fat_paged_entry(fs, cluster) & FAT_TABLE_MARKED)
+
+static uint32_t
+fs_fat_paged_entry(FSInfo *fs, int cluster)
+{
+	FSFatPages *fp = fs->fat_pages;
+	FatPage *p;
+	FatPage *victim = &fp->pages[0];
+	int page = cluster/FAT_PAGE_ENTRIES;
+	uint32_t entry;
+	int i;
+
+	for (i = 0; i < FS_FAT_PAGES; i++)
+	{
+		p = &fp->pages[i];
+		if (p->page == page)
+			goto found;
+		if (p->last_used < victim->last_used)
+			victim = p;
+	}
+
+	p = victim;
+	p->page = -1;
+	if (!fs_read(fs, p->raw, -1, 256*fs->block_size+page*FAT_PAGE_BYTES, FAT_PAGE_BYTES, FS_READ_FAT))
+		return FAT_UNREADABLE;
+	p->page = page;
+
+found:
+	p->last_used = ++fp->clock;
+	fs_fat_decode(&entry, p->raw+(cluster%FAT_PAGE_ENTRIES)*3, 1);
+	return entry;
+}
+
+/*
+ * Stream the FAT through the first page buffer to compute its CRC.
+ */
+static int
+fs_fat_paged_crc(FSInfo *fs)
+{
+	FatPage *p = &fs->fat_pages->pages[0];
+	uint32_t crc = FS_CRC32_INIT;
+	int offset;
+	int bytes;
+
+	if (fs->fat_crc_size < 0 || fs->fat_pages->crc_done)
+		return 1;
+
+	p->page = -1;
+	p->last_used = 0;
+	for (offset = 0; offset < fs->fat_crc_size; offset += bytes)
+	{
+		bytes = MIN(FAT_PAGE_BYTES, fs->fat_crc_size-offset);
+		if (!fs_read(fs, p->raw, -1, 256*fs->block_size+offset, bytes, FS_READ_FAT))
+			return 0;
+		crc = fs_crc32(crc, p->raw, bytes);
+	}
+	fs->fat_crc32_computed = crc;
+	fs->fat_pages->crc_done = 1;
+	return 1;
+}
+
 static int
 fs_load_fat(FSInfo *fs)
 {
-	int fat_start = 256*fs->block_size;
-	int fat_size = 768*fs->block_size;
+	int i;
 
-	if ((fs->fat = malloc(fat_size)) == 0)
+	if ((fs->fat_pages = malloc(sizeof(FSFatPages))) == 0)
 	{
 		no_memory("fs_load_fat");
 		return 0;
 	}
+	fs->fat_pages->clock = 0;
+	fs->fat_pages->crc_done = 0;
+	for (i = 0; i < FS_FAT_PAGES; i++)
+	{
+		fs->fat_pages->pages[i].page = -1;
+		fs->fat_pages->pages[i].last_used = 0;
+	}
 
-	if (!fs_read(fs, fs->fat, -1, fat_start, fat_size))
+	fs->fat_crc_size = fs_fat_crc_size(fs, FAT_BYTES(fs));
+	if (fs_fat_verify_on_load && (!fs_fat_paged_crc(fs) || !fs_fat_crc_ok(fs)))
 	{
-		free(fs->fat);
-		fs->fat = 0;
+		if (fs->fat_pages->crc_done || fs->fat_crc_size < 0)
+			fs_fat_crc_mismatch(fs);
+		free(fs->fat_pages);
+		fs->fat_pages = 0;
 		return 0;
 	}
 
+	if (FS_FAT_INDEX)
+		fs->chains = fs_fat_index_build(fs);
+
 	return 1;
 }
 
+#else
+
+#define fs_fat_loaded(fs)	((fs)->fat != 0)
+#define fs_fat_entry(fs, cluster)	((fs)->fat[cluster] & FAT_TABLE_VALUE)
+#define fs_fat_entry_marked(fs, cluster)	((fs)->fat[cluster] & FAT_TABLE_MARKED)
+
 static int
-fs_fat_entry(FSInfo *fs, int cluster)
+fs_load_fat(FSInfo *fs)
 {
-	FATEntry fe;
+	int fat_start = 256*fs->block_size;
+	int fat_size = FAT_BYTES(fs);
+	uint8_t *raw;
 
-	cluster *= 3;
-	fe.raw.zero = 0;
-	fe.raw.bytes[0] = fs->fat[cluster++];
-	fe.raw.bytes[1] = fs->fat[cluster++];
-	fe.raw.bytes[2] = fs->fat[cluster++];
-	return be32toh(fe.value);
-}
+	if ((raw = malloc(fat_size)) == 0)
+	{
+		no_memory("fs_load_fat");
+		return 0;
+	}
 
-static void
-fs_fat_set_entry(FSInfo *fs, int cluster, int value)
-{
-	FATEntry fe;
+	if (!fs_read(fs, raw, -1, fat_start, fat_size, FS_READ_FAT))
+	{
+		free(raw);
+		return 0;
+	}
+
+	if ((fs->fat_crc_size = fs_fat_crc_size(fs, fat_size)) >= 0)
+		fs->fat_crc32_computed = fs_crc32(FS_CRC32_INIT, raw, fs->fat_crc_size);
+	if (fs_fat_verify_on_load && !fs_fat_crc_ok(fs))
+	{
+		fs_fat_crc_mismatch(fs);
+		free(raw);
+		return 0;
+	}
+
+	if ((fs->fat = malloc(FAT_ENTRIES(fs)*sizeof(uint32_t))) == 0)
+	{
+		no_memory("fs_load_fat");
+		free(raw);
+		return 0;
+	}
+	fs_fat_decode(fs->fat, raw, FAT_ENTRIES(fs));
+	free(raw);
+
+	/* Without the index we just walk chains, so failure isn't fatal. */
+	if (FS_FAT_INDEX)
+		fs->chains = fs_fat_index_build(fs);
 
-	fe.value = htobe32(value);
-	cluster *= 3;
-	fs->fat[cluster++] = fe.raw.bytes[0];
-	fs->fat[cluster++] = fe.raw.bytes[1];
-	fs->fat[cluster++] = fe.raw.bytes[2];
+	return 1;
 }
 
-typedef int (*EachClusterFn)(FSInfo *fs, void *arg, int cluster, int index);
+#endif
 
-static int fs_fat_marking_clusters = 0;
+typedef int (*EachClusterFn)(FSInfo *fs, void *arg, int cluster, int index);
 
 /*
- * TODO: could mark each cluster as we visit it to detect loops in the
- * FAT more accurately.
+ * Follow a chain from start_cluster, calling fn for each cluster.
+ * Returns the length of the chain, 0 if fn stops early or -1 if the
+ * chain is broken. Loops are caught with Brent's algorithm: a marker is
+ * left on the cluster reached after 1, 2, 4, 8... steps, and the chain
+ * loops if it comes back to the marker before the next one is due. That
+ * needs no memory, which matters on the TAP where every open walks its
+ * chain, at the cost of fn seeing up to twice the loop's length in
+ * clusters before it's noticed.
  */
 static int
 fs_fat_each_cluster(FSInfo *fs, int start_cluster, EachClusterFn fn, void *arg)
 {
 	int cluster;
+	int marker;
+	int power = 1;
+	int steps = 0;
 	int i;
 	int next_cluster;
-	int marked;
 
-	cluster = start_cluster;
-	i = 0;
-	while (i < 131072) {
-// printf("cluster %d: %d\n", i, cluster);
+	if (start_cluster < 0 || start_cluster >= FAT_ENTRIES(fs))
+	{
+		fs_error("chain starts at cluster %d which is out of range", start_cluster);
+		return -1;
+	}
+
+	cluster = marker = start_cluster;
+	for (i = 0; ; i++)
+	{
 		if (fn && !fn(fs, arg, cluster, i))
 			return 0;
 		next_cluster = fs_fat_entry(fs, cluster);
-// printf("raw next cluster %d (0x%x)\n", next_cluster, next_cluster);
-		marked = FAT_CLUSTER_IS_MARKED(next_cluster);
-		next_cluster = FAT_CLUSTER_UNMARKED(next_cluster);
-// printf("next cluster %d (0x%x)%s\n", next_cluster, next_cluster, marked? " marked" : "");
+#if FS_FAT_PAGED
+		if (next_cluster == FAT_UNREADABLE)
+			return -1;
+#endif
 		if (next_cluster == FAT_FREE)
 		{
 			fs_error("free cluster found in cluster chain");
@@ -124,67 +350,564 @@ fs_fat_each_cluster(FSInfo *fs, int start_cluster, EachClusterFn fn, void *arg)
 		}
 		else if (next_cluster == FAT_CHAIN_END)
 			return i+1;
-		if (next_cluster > 131071)
+		if (next_cluster >= FAT_ENTRIES(fs))
 		{
 			fs_error("FAT entry for cluster %d points to cluster %d which is out of range", cluster, next_cluster);
 			return -1;
 		}
+		if (next_cluster == marker)
+		{
+			fs_error("chain starting with cluster %d loops back from cluster %d to cluster %d", start_cluster, cluster, next_cluster);
+			return -1;
+		}
+		if (++steps == power)
+		{
+			marker = next_cluster;
+			power *= 2;
+			steps = 0;
+		}
 		cluster = next_cluster;
-		i++;
 	}
-	fs_error("more than 131072 clusters in chain starting with cluster %d: loop in FAT?", start_cluster);
-	return -1;
 }
 
-static uint64_t fs_fat_remaining_bytes;
+typedef struct {
+	Extent *extents;
+	int num_extents;
+	int max_extents;
+} RecordExtents;
 
 static int
-fs_fat_record_cluster_fn(FSInfo *fs, void *arg, int cluster, int index)
+fs_fat_record_extent_fn(FSInfo *fs, void *arg, int cluster, int index)
 {
-	Cluster *clusters = (Cluster *)arg;
-	int bytes_used;
+	RecordExtents *re = (RecordExtents *)arg;
+	Extent *e;
+	Extent *new_extents;
+
+	if (re->num_extents > 0)
+	{
+		e = &re->extents[re->num_extents-1];
+		if (e->cluster+e->clusters == cluster)
+		{
+			e->clusters++;
+			return 1;
+		}
+	}
 
-	bytes_used = MIN(fs->bytes_per_cluster, fs_fat_remaining_bytes);
-	clusters[index].cluster = cluster;
-	clusters[index].bytes_used = bytes_used;
-	fs_fat_remaining_bytes -= bytes_used;
+	if (re->num_extents == re->max_extents)
+	{
+		re->max_extents *= 2;
+		if ((new_extents = realloc(re->extents, re->max_extents*sizeof(Extent))) == 0)
+		{
+			no_memory("fs_fat_chain");
+			return 0;
+		}
+		re->extents = new_extents;
+	}
+	e = &re->extents[re->num_extents++];
+	e->cluster = cluster;
+	e->clusters = 1;
+	e->offset = (uint64_t)index*fs->bytes_per_cluster;
+	e->bytes = 0;
 	return 1;
 }
 
-Cluster *
-fs_fat_chain(FSInfo *fs, int start_cluster, int *cluster_count, uint64_t filesize)
+/*
+ * Share out the bytes of a file of the given size between its extents.
+ * Returns the number shared out, which is less than filesize if the
+ * extents can't hold that many.
+ */
+uint64_t
+fs_extents_set_size(FSInfo *fs, Extent *extents, int extent_count, uint64_t filesize)
 {
-	Cluster *clusters;
+	uint64_t shared = 0;
+	uint64_t span;
 	int i;
-	int cluster;
-	int num_clusters;
 
-	if (!fs->fat && !fs_load_fat(fs))
+	for (i = 0; i < extent_count; i++)
+	{
+		span = (uint64_t)extents[i].clusters*fs->bytes_per_cluster;
+		extents[i].bytes = MIN(span, filesize-shared);
+		shared += extents[i].bytes;
+	}
+	return shared;
+}
+
+/*
+ * Every file open used to walk its chain. Instead, when the FAT is loaded
+ * we decompose the whole of it into chains in one pass and keep the
+ * extents of each, so opening a file is a lookup.
+ *
+ * A chain starts at an allocated cluster that no other entry points to.
+ * Each chain is followed to its end, marking clusters with the chain
+ * they belong to as we go. Every cluster is visited at most once, so the
+ * whole job is linear in the size of the FAT, and it doubles as a check
+ * of the whole FAT: a chain that runs into a free cluster, points out of
+ * range, comes back to one of its own clusters (a loop) or runs into a
+ * cluster of an earlier chain (a cross-link) is recorded as a problem.
+ * Allocated clusters left unvisited at the end can only be loops that
+ * no chain leads into.
+ *
+ * Opening a broken chain then fails straight away with the problem
+ * found here. A cross-linked file is still readable, so it is walked,
+ * as is any chain that doesn't start at a chain start.
+ */
+
+typedef struct {
+	int start;
+	int clusters;
+	int first_extent;
+	int num_extents;
+	int problem;		/* index into problems, or -1 */
+} FSChain;
+
+struct FSChainIndex {
+	int *chain_at;		/* chain starting at each cluster, or -1 */
+	FSChain *chains;
+	int num_chains;
+	Extent *extents;	/* bytes is the whole span of each extent */
+	int num_extents;
+	FSChainProblem *problems;
+	int num_problems;
+};
+
+#define FAT_HAS_PRED	1
+#define FAT_VISITED	2
+
+static int
+fs_fat_index_grow(void **array, int *max, int size)
+{
+	void *new_array;
+	int new_max = *max? 2*(*max) : 1024;
+
+	if ((new_array = realloc(*array, new_max*size)) == 0)
 		return 0;
+	*array = new_array;
+	*max = new_max;
+	return 1;
+}
+
+static void
+fs_fat_index_free(FSChainIndex *ix)
+{
+	if (!ix)
+		return;
+	free(ix->chain_at);
+	free(ix->chains);
+	free(ix->extents);
+	free(ix->problems);
+	free(ix);
+}
 
-	if ((num_clusters = fs_fat_each_cluster(fs, start_cluster, 0, 0)) < 0)
+static int
+fs_fat_index_problem(FSChainIndex *ix, int *max_problems, FSChainStatus status,
+		int start, int cluster, int next, int other)
+{
+	FSChainProblem *p;
+
+	if (ix->num_problems == *max_problems
+		&& !fs_fat_index_grow((void **)&ix->problems, max_problems, sizeof(FSChainProblem)))
+		return -1;
+	p = &ix->problems[ix->num_problems];
+	p->status = status;
+	p->start = start;
+	p->cluster = cluster;
+	p->next = next;
+	p->other = other;
+	return ix->num_problems++;
+}
+
+void
+fs_fat_describe_problem(FSChainProblem *p, char *buf, int size)
+{
+	switch (p->status)
+	{
+	case FS_CHAIN_ENDS_FREE:
+		snprintf(buf, size, "chain from cluster %d: cluster %d points to free cluster %d",
+				p->start, p->cluster, p->next);
+		break;
+	case FS_CHAIN_OUT_OF_RANGE:
+		snprintf(buf, size, "chain from cluster %d: cluster %d points to cluster %d, which is out of range",
+				p->start, p->cluster, p->next);
+		break;
+	case FS_CHAIN_LOOP:
+		if (p->start < 0)
+			snprintf(buf, size, "cluster %d points back to cluster %d in a loop that no chain leads into",
+					p->cluster, p->next);
+		else
+			snprintf(buf, size, "chain from cluster %d: cluster %d loops back to cluster %d",
+					p->start, p->cluster, p->next);
+		break;
+	case FS_CHAIN_CROSS_LINKED:
+		snprintf(buf, size, "chain from cluster %d: cluster %d points to cluster %d, which is also in the chain from cluster %d",
+				p->start, p->cluster, p->next, p->other);
+		break;
+	default:
+		snprintf(buf, size, "chain from cluster %d is fine", p->start);
+		break;
+	}
+}
+
+static FSChainIndex *
+fs_fat_index_build(FSInfo *fs)
+{
+	FSChainIndex *ix;
+	uint8_t *state;
+	int *chain_of;
+	int max_chains = 0;
+	int max_extents = 0;
+	int max_problems = 0;
+	int first_extent;
+	int start;
+	int cluster;
+	int next;
+	int length;
+	int problem;
+	FSChain *chain;
+	Extent *e;
+
+	if ((ix = malloc(sizeof(FSChainIndex))) == 0)
 		return 0;
+	memset(ix, 0, sizeof(FSChainIndex));
+	state = calloc(FAT_ENTRIES(fs), 1);
+	chain_of = malloc(FAT_ENTRIES(fs)*sizeof(int));
+	ix->chain_at = malloc(FAT_ENTRIES(fs)*sizeof(int));
+	if (!state || !chain_of || !ix->chain_at)
+		goto fail;
 
-// printf("from cluster %d found %d clusters\n", start_cluster, num_clusters);
+	for (cluster = 0; cluster < FAT_ENTRIES(fs); cluster++)
+	{
+		ix->chain_at[cluster] = -1;
+		next = fs_fat_entry(fs, cluster);
+		if (next < FAT_ENTRIES(fs))
+			state[next] |= FAT_HAS_PRED;
+	}
 
-	if (num_clusters != *cluster_count)
+	for (start = 0; start < FAT_ENTRIES(fs); start++)
 	{
-		fs_warn("found %d clusters in chain starting from cluster %d, was expecting %d clusters", num_clusters, start_cluster, cluster_count);
-		*cluster_count = num_clusters;
+		if (fs_fat_entry(fs, start) == FAT_FREE || (state[start] & (FAT_HAS_PRED|FAT_VISITED)))
+			continue;
+
+		first_extent = ix->num_extents;
+		length = 0;
+		problem = -1;
+		cluster = start;
+		for (;;)
+		{
+			state[cluster] |= FAT_VISITED;
+			chain_of[cluster] = ix->num_chains;
+			e = ix->num_extents > first_extent? &ix->extents[ix->num_extents-1] : 0;
+			if (e && e->cluster+e->clusters == cluster)
+			{
+				e->clusters++;
+			}
+			else
+			{
+				if (ix->num_extents == max_extents
+					&& !fs_fat_index_grow((void **)&ix->extents, &max_extents, sizeof(Extent)))
+					goto fail;
+				e = &ix->extents[ix->num_extents++];
+				e->cluster = cluster;
+				e->clusters = 1;
+				e->offset = (uint64_t)length*fs->bytes_per_cluster;
+			}
+			length++;
+
+			next = fs_fat_entry(fs, cluster);
+			if (next == FAT_CHAIN_END)
+				break;
+			if (next >= FAT_ENTRIES(fs))
+				problem = fs_fat_index_problem(ix, &max_problems, FS_CHAIN_OUT_OF_RANGE,
+						start, cluster, next, -1);
+			else if (fs_fat_entry(fs, next) == FAT_FREE)
+				problem = fs_fat_index_problem(ix, &max_problems, FS_CHAIN_ENDS_FREE,
+						start, cluster, next, -1);
+			else if ((state[next] & FAT_VISITED) && chain_of[next] == ix->num_chains)
+				problem = fs_fat_index_problem(ix, &max_problems, FS_CHAIN_LOOP,
+						start, cluster, next, -1);
+			else if (state[next] & FAT_VISITED)
+				problem = fs_fat_index_problem(ix, &max_problems, FS_CHAIN_CROSS_LINKED,
+						start, cluster, next, ix->chains[chain_of[next]].start);
+			else
+			{
+				cluster = next;
+				continue;
+			}
+			if (problem < 0)
+				goto fail;
+			break;
+		}
+
+		/* Broken chains keep no extents; the problem says what's wrong. */
+		if (problem >= 0)
+			ix->num_extents = first_extent;
+
+		if (ix->num_chains == max_chains
+			&& !fs_fat_index_grow((void **)&ix->chains, &max_chains, sizeof(FSChain)))
+			goto fail;
+		chain = &ix->chains[ix->num_chains];
+		chain->start = start;
+		chain->clusters = length;
+		chain->first_extent = first_extent;
+		chain->num_extents = ix->num_extents-first_extent;
+		chain->problem = problem;
+		ix->chain_at[start] = ix->num_chains++;
 	}
 
-	if ((clusters = malloc((num_clusters)*sizeof(Cluster))) == 0)
+	/* Whatever is left is in loops with no way in. */
+	for (start = 0; start < FAT_ENTRIES(fs); start++)
 	{
-		no_memory("fs_fat_chain");
-		return 0;
+		if (fs_fat_entry(fs, start) == FAT_FREE || (state[start] & FAT_VISITED))
+			continue;
+		for (cluster = start; ; cluster = next)
+		{
+			state[cluster] |= FAT_VISITED;
+			next = fs_fat_entry(fs, cluster);
+			if (next >= FAT_ENTRIES(fs) || (state[next] & FAT_VISITED))
+				break;
+		}
+		if (fs_fat_index_problem(ix, &max_problems, FS_CHAIN_LOOP, -1, cluster, next, -1) < 0)
+			goto fail;
 	}
 
-	fs_fat_remaining_bytes = filesize;
-	if (fs_fat_each_cluster(fs, start_cluster, fs_fat_record_cluster_fn, clusters) < 0)
+	free(chain_of);
+	free(state);
+	return ix;
+
+fail:
+	free(chain_of);
+	free(state);
+	fs_fat_index_free(ix);
+	return 0;
+}
+
+/*
+ * Load the FAT if it isn't already, and say whether its CRC matches the
+ * superblock's: 1 if it does, 0 if not, or -1 if the FAT can't be read.
+ */
+int
+fs_fat_verify(FSInfo *fs)
+{
+	if (!fs_fat_loaded(fs) && !fs_load_fat(fs))
+		return -1;
+#if FS_FAT_PAGED
+	if (!fs_fat_paged_crc(fs))
+		return -1;
+#endif
+	return fs_fat_crc_ok(fs);
+}
+
+/*
+ * Check the whole FAT, calling fn for each problem found. Returns the
+ * number of problems, or -1 if the check couldn't be done.
+ */
+int
+fs_fat_check(FSInfo *fs, FSChainProblemFn fn, void *arg)
+{
+	FSChainIndex *ix;
+	int n;
+	int i;
+
+	if (!fs_fat_loaded(fs) && !fs_load_fat(fs))
+		return -1;
+	if ((ix = fs->chains) == 0 && (ix = fs_fat_index_build(fs)) == 0)
 	{
-		free(clusters);
+		no_memory("fs_fat_check");
+		return -1;
+	}
+
+	for (i = 0; i < ix->num_problems; i++)
+		if (fn && !fn(arg, &ix->problems[i]))
+			break;
+	n = ix->num_problems;
+
+	if (ix != fs->chains)
+		fs_fat_index_free(ix);
+	return n;
+}
+
+/*
+ * Count free space on the disk, in one pass over the FAT. FAT entries
+ * past the end of the disk are free but don't exist, so they're left
+ * out.
+ */
+int
+fs_fat_usage(FSInfo *fs, FSFatUsage *usage)
+{
+	int64_t clusters;
+	int cluster;
+	int run = 0;
+	int b;
+
+	if (!fs_fat_loaded(fs) && !fs_load_fat(fs))
 		return 0;
+
+	memset(usage, 0, sizeof(FSFatUsage));
+	clusters = blkio_total_blocks(fs->disk->dev)/fs->blocks_per_cluster - 1;
+	usage->clusters = MAX(0, MIN(clusters, FAT_ENTRIES(fs)));
+
+	for (cluster = 0; cluster <= usage->clusters; cluster++)
+	{
+		if (cluster < usage->clusters && fs_fat_entry(fs, cluster) == FAT_FREE)
+		{
+			run++;
+			continue;
+		}
+		if (run == 0)
+			continue;
+
+		for (b = 0; (run >> (b+1)) > 0 && b < FS_FREE_RUN_BUCKETS-1; b++)
+			;
+		usage->free_run_hist[b]++;
+		usage->free_run_clusters[b] += run;
+		usage->free_clusters += run;
+		usage->free_runs++;
+		if (run > usage->largest_free_run)
+			usage->largest_free_run = run;
+		run = 0;
+	}
+	return 1;
+}
+
+void
+fs_fat_close(FSInfo *fs)
+{
+	fs_fat_index_free(fs->chains);
+	fs->chains = 0;
+	free(fs->fat);
+	fs->fat = 0;
+	free(fs->fat_pages);
+	fs->fat_pages = 0;
+}
+
+/*
+ * Return the chain from start_cluster as a list of extents, from the
+ * index if we can, otherwise by walking it. The directory entry's idea
+ * of the number of clusters and the size are passed in, and corrected if
+ * the chain is shorter: a file can only be read as far as its chain goes.
+ */
+Extent *
+fs_fat_chain(FSInfo *fs, int start_cluster, int *cluster_count, uint64_t *filesize, int *extent_count)
+{
+	uint64_t size;
+	RecordExtents re;
+	FSChain *chain = 0;
+	FSChainProblem *problem;
+	char msg[160];
+	int num_clusters;
+
+	if (!fs_fat_loaded(fs) && !fs_load_fat(fs))
+		return 0;
+
+	if (fs->chains && start_cluster >= 0 && start_cluster < FAT_ENTRIES(fs)
+		&& fs->chains->chain_at[start_cluster] >= 0)
+		chain = &fs->chains->chains[fs->chains->chain_at[start_cluster]];
+
+	if (chain && chain->problem >= 0)
+	{
+		problem = &fs->chains->problems[chain->problem];
+		if (problem->status != FS_CHAIN_CROSS_LINKED)
+		{
+			fs_fat_describe_problem(problem, msg, sizeof(msg));
+			fs_error("%s", msg);
+			return 0;
+		}
+		chain = 0;	/* still readable, so walk it */
+	}
+
+	if (chain)
+	{
+		num_clusters = chain->clusters;
+		re.num_extents = chain->num_extents;
+		if ((re.extents = malloc(re.num_extents*sizeof(Extent))) == 0)
+		{
+			no_memory("fs_fat_chain");
+			return 0;
+		}
+		memcpy(re.extents, &fs->chains->extents[chain->first_extent], re.num_extents*sizeof(Extent));
+	}
+	else
+	{
+		re.num_extents = 0;
+		re.max_extents = 4;
+		if ((re.extents = malloc(re.max_extents*sizeof(Extent))) == 0)
+		{
+			no_memory("fs_fat_chain");
+			return 0;
+		}
+		if ((num_clusters = fs_fat_each_cluster(fs, start_cluster, fs_fat_record_extent_fn, &re)) <= 0)
+		{
+			free(re.extents);
+			return 0;
+		}
+	}
+
+	if (num_clusters != *cluster_count)
+	{
+		fs_warn("found %d clusters in chain starting from cluster %d, was expecting %d clusters", num_clusters, start_cluster, *cluster_count);
+		*cluster_count = num_clusters;
 	}
 
-	return clusters;
+	if ((size = fs_extents_set_size(fs, re.extents, re.num_extents, *filesize)) < *filesize)
+	{
+		fs_warn("chain starting from cluster %d is too short for the file's size; reading only its %d clusters", start_cluster, num_clusters);
+		*filesize = size;
+	}
+	*extent_count = re.num_extents;
+	return re.extents;
+}
+
+#if defined(TEST) && !FS_FAT_PAGED
+
+/*
+ * Build with -DTEST and the Unix objects other than fs_fat.o.
+ */
+
+static void
+check_short_chain(FSInfo *fs, char *name)
+{
+	int clusters = 6;
+	uint64_t filesize = 6*fs->bytes_per_cluster - 100;
+	int num_extents;
+	Extent *extents;
+
+	extents = fs_fat_chain(fs, 10, &clusters, &filesize, &num_extents);
+	if (!extents || clusters != 3 || filesize != 3*fs->bytes_per_cluster || num_extents != 2
+		|| extents[0].bytes != 2*fs->bytes_per_cluster || extents[1].bytes != fs->bytes_per_cluster)
+		printf("%-8s FAILED\n", name);
+	else
+		printf("%-8s ok\n", name);
+	free(extents);
+}
+
+int
+main(void)
+{
+	FSInfo fs;
+	int i;
+
+	memset(&fs, 0, sizeof(fs));
+	fs.block_size = 512;
+	fs.blocks_per_cluster = 4;
+	fs.bytes_per_cluster = 2048;
+	fs.fat = malloc(FAT_ENTRIES(&fs)*sizeof(uint32_t));
+	for (i = 0; i < FAT_ENTRIES(&fs); i++)
+		fs.fat[i] = FAT_FREE;
+
+	/*
+	 * A file whose directory entry says six clusters, but whose chain
+	 * was cut short after three, the last of them out of line. The file
+	 * must be cut down to what the chain holds.
+	 */
+	fs.fat[10] = 11;
+	fs.fat[11] = 20;
+	fs.fat[20] = FAT_CHAIN_END;
+
+	check_short_chain(&fs, "walked");
+	fs.chains = fs_fat_index_build(&fs);
+	check_short_chain(&fs, "indexed");
+
+	fs_fat_close(&fs);
+	return 0;
 }
+
+#endif
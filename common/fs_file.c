@@ -33,35 +33,60 @@
 /* Work in units of 'chunks' by default. */
 #define DEFAULT_BUFFER_SIZE 188
 
-static DirEntry file_fake_root_dir_entry;
+/*
+ * File data is read in bigger pieces, as long as the clusters are
+ * contiguous on the disk.
+ */
+#define FILE_DATA_BUFFER_SIZE (2*1024*1024)
+
+/*
+ * The most file_read_into() asks fs_read() for at once.
+ */
+#define FILE_READ_INTO_MAX (1024*1024*1024)
+
+/*
+ * Start reading ahead after this many sequential reads, keeping this
+ * many chunks ahead of the reader.
+ */
+#define FILE_READAHEAD_AFTER 2
+#define FILE_READAHEAD_CHUNKS 4
 
+/*
+ * Filled in by the caller rather than cached in a static so that several
+ * threads can open the root at once.
+ */
 static DirEntry *
-file_fake_root(FSInfo *fs)
+file_fake_root(FSInfo *fs, DirEntry *r)
 {
-	DirEntry *r = &file_fake_root_dir_entry;
 	int i;
 
-	if (r->type == 0)
-	{
-		r->type = DIR_ENTRY_ROOT;
-		for (i = 0; i < sizeof(r->mtime); i++)
-			r->mtime[i] = 0xff;
-		r->start_cluster = htobe32(fs->root_dir_cluster);
-		r->clusters = htobe32(1);
-		r->unused_bytes_in_last_cluster = htobe32(fs->unused_bytes_in_root);
-		r->filename[0] = '/';
-	}
+	memset(r, 0, sizeof(DirEntry));
+	r->type = DIR_ENTRY_ROOT;
+	for (i = 0; i < sizeof(r->mtime); i++)
+		r->mtime[i] = 0xff;
+	r->start_cluster = htobe32(fs->root_dir_cluster);
+	r->clusters = htobe32(1);
+	r->unused_bytes_in_last_cluster = htobe32(fs->unused_bytes_in_root);
+	r->filename[0] = '/';
 
 	return r;
 }
 
+static void
+file_handle_free(FileHandle *file)
+{
+	mutex_destroy(&file->lock);
+	free(file);
+}
+
 static FileHandle *
 file_handle_init(char *where, FSInfo *fs, DirEntry *entry)
 {
 	FileHandle *file;
 	int clusters;
-	int unused;
+	uint64_t filesize;
 	int filesize_needs_fixup;
+	int is_dir;
 
 	if ((file = malloc(sizeof(FileHandle))) == 0)
 	{
@@ -70,7 +95,7 @@ file_handle_init(char *where, FSInfo *fs, DirEntry *entry)
 	}
 
 	file->fs = fs;
-	file->buffer_size = DEFAULT_BUFFER_SIZE*fs->block_size;
+	file->start_cluster = be32toh(entry->start_cluster);
 	file->buffer = 0;
 	file->nread = 0;
 	switch (entry->type) {
@@ -89,24 +114,65 @@ file_handle_init(char *where, FSInfo *fs, DirEntry *entry)
 		 * time being, set the file size to the whole cluster.
 		 * We'll fix it when we first read the file.
 		 */
-		unused = 0;
+		filesize = fs->bytes_per_cluster;
 		filesize_needs_fixup = 1;
+		is_dir = 1;
 		break;
 	case DIR_ENTRY_DOT:	/* '.' entries have valid sizes */
 	case DIR_ENTRY_ROOT:	/* Our fake entry has valid sizes */
 	case DIR_ENTRY_FILEA:
 	case DIR_ENTRY_FILET:
+		is_dir = entry->type == DIR_ENTRY_DOT || entry->type == DIR_ENTRY_ROOT;
 		clusters = be32toh(entry->clusters);
-		unused = be32toh(entry->unused_bytes_in_last_cluster);
-		if (entry->s3_crc)
-			unused = unused+512-be16toh(entry->bytes_in_last_block);
+		filesize = fs_dir_entry_size(fs, entry);
 		filesize_needs_fixup = 0;
 		break;
 	}
+	file->is_dir = is_dir;
+	if (is_dir)
+		file->buffer_size = DEFAULT_BUFFER_SIZE*fs->block_size;
+	else
+		file->buffer_size = FILE_DATA_BUFFER_SIZE & ~(fs->block_size-1);
 	file->filesize_needs_fixup = filesize_needs_fixup;
-	file->filesize = (uint64_t)clusters*fs->bytes_per_cluster - unused;
+	file->filesize = filesize;
 	file->num_clusters = clusters;
+	file->num_extents = 0;
+	file->cur_extent = 0;
+	file->extents = 0;
 	file->offset = 0;
+	file->sequential = 0;
+	file->readahead_last = 0;
+	file->readahead_next = 0;
+	file->extent_of = 0;
+	mutex_init(&file->lock);
+
+	return file;
+}
+
+/*
+ * Open the file a pathname cache lookup found, if it found one.
+ */
+static FileHandle *
+file_open_dcache(FSInfo *fs, int parent, char *name)
+{
+	DirEntry entry;
+	FileHandle *file;
+	Extent *extents;
+	int num_extents;
+	int num_clusters;
+
+	if ((extents = fs_dcache_lookup(fs->dcache, parent, name, &entry, &num_extents, &num_clusters)) == 0)
+		return 0;
+	if ((file = file_handle_init("file_open_dcache", fs, &entry)) == 0)
+	{
+		free(extents);
+		return 0;
+	}
+	file->extents = extents;
+	file->num_extents = num_extents;
+	file->num_clusters = num_clusters;
+	/* Cut down to what the chain holds, as fs_fat_chain() did. */
+	file->filesize = fs_extents_set_size(fs, extents, num_extents, file->filesize);
 
 	return file;
 }
@@ -114,18 +180,24 @@ file_handle_init(char *where, FSInfo *fs, DirEntry *entry)
 FileHandle *
 file_open_root(FSInfo *fs)
 {
-	DirEntry *root = file_fake_root(fs);
+	DirEntry root_entry;
+	DirEntry *root = file_fake_root(fs, &root_entry);
 	FileHandle *file;
 
+	if ((file = file_open_dcache(fs, -1, root->filename)) != 0)
+		return file;
+
 	if ((file = file_handle_init("file_open_root", fs, root)) == 0)
 		return 0;
 
-	if ((file->clusters = fs_fat_chain(fs, fs->root_dir_cluster, &file->num_clusters, file->filesize)) == 0)
+	if ((file->extents = fs_fat_chain(fs, fs->root_dir_cluster, &file->num_clusters,
+			&file->filesize, &file->num_extents)) == 0)
 	{
-		free(file);
+		file_handle_free(file);
 		return 0;
 	}
 
+	fs_dcache_insert(fs->dcache, -1, root, file->extents, file->num_extents, file->num_clusters);
 	return file;
 }
 
@@ -139,9 +211,10 @@ file_open_dir_entry(FileHandle *dir, DirEntry *entry)
 		return 0;
 
 	start_cluster = be32toh(entry->start_cluster);
-	if ((file->clusters = fs_fat_chain(dir->fs, start_cluster, &file->num_clusters, file->filesize)) == 0)
+	if ((file->extents = fs_fat_chain(dir->fs, start_cluster, &file->num_clusters,
+			&file->filesize, &file->num_extents)) == 0)
 	{
-		free(file);
+		file_handle_free(file);
 		return 0;
 	}
 
@@ -151,11 +224,33 @@ file_open_dir_entry(FileHandle *dir, DirEntry *entry)
 FileHandle *
 file_open(FileHandle *dir, char *filename)
 {
-	DirEntry *entry;
+	DirEntry entry;
 
-	if ((entry = fs_dir_find(dir, filename)) == 0)
+	if (!fs_dir_find(dir, filename, &entry))
 		return 0;
-	return file_open_dir_entry(dir, entry);
+	return file_open_dir_entry(dir, &entry);
+}
+
+/*
+ * Open filename in dir, trying the pathname cache before reading the
+ * directory.
+ */
+static FileHandle *
+file_open_lookup(FileHandle *dir, char *filename)
+{
+	FileHandle *file;
+	DirEntry entry;
+
+	if ((file = file_open_dcache(dir->fs, dir->start_cluster, filename)) != 0)
+		return file;
+
+	if (!fs_dir_find(dir, filename, &entry)
+			|| (file = file_open_dir_entry(dir, &entry)) == 0)
+		return 0;
+
+	fs_dcache_insert(dir->fs->dcache, dir->start_cluster, &entry, file->extents,
+			file->num_extents, file->num_clusters);
+	return file;
 }
 
 FileHandle *
@@ -188,7 +283,7 @@ file_open_pathname(FSInfo *fs, FileHandle *dir, char *pathname)
 		e = strchr(s, '/');
 		if (e)
 			*e = 0;
-		if ((next = file_open(cur, s)) == 0)
+		if ((next = file_open_lookup(cur, s)) == 0)
 		{
 			fs_warn("could not find '%s'", s);
 			if (need_close)
@@ -208,24 +303,27 @@ file_open_pathname(FSInfo *fs, FileHandle *dir, char *pathname)
 	return cur;
 }
 
+static void file_buffer_free(FileHandle *file);
+
 void
 file_close(FileHandle *file)
 {
-	free(file->buffer);
-	free(file->clusters);
-	free(file);
+	file_buffer_free(file);
+	free(file->extents);
+	free(file->extent_of);
+	file_handle_free(file);
 }
 
+/*
+ * Buffers come from the block IO layer's pool, so they are suitable for
+ * direct IO and are recycled rather than malloc'd for every file.
+ */
 static char *
 file_buffer_alloc(FileHandle *file)
 {
 	if (!file->buffer)
 	{
-		if ((file->buffer = malloc(file->buffer_size)) == 0)
-		{
-			no_memory("file_buffer_alloc");
-			return 0;
-		}
+		file->buffer = blkio_buffer_alloc(file->fs->disk->dev, file->buffer_size);
 	}
 
 	return file->buffer;
@@ -234,53 +332,396 @@ file_buffer_alloc(FileHandle *file)
 static void
 file_buffer_free(FileHandle *file)
 {
-	free(file->buffer);
+	blkio_buffer_free(file->fs->disk->dev, file->buffer, file->buffer_size);
 	file->buffer = 0;
 }
 
-char *
-file_read(FileHandle *file)
+/*
+ * Find the extent holding offset. Reads are mostly sequential, so start
+ * from the one we used last time.
+ */
+static Extent *
+file_extent(FileHandle *file, uint64_t offset)
+{
+	Extent *e = &file->extents[file->cur_extent];
+	int lo;
+	int hi;
+	int mid;
+
+	if (offset >= e->offset && offset-e->offset < e->bytes)
+		return e;
+	if (file->cur_extent+1 < file->num_extents)
+	{
+		e++;
+		if (offset >= e->offset && offset-e->offset < e->bytes)
+		{
+			file->cur_extent++;
+			return e;
+		}
+	}
+
+	lo = 0;
+	hi = file->num_extents-1;
+	while (lo < hi)
+	{
+		mid = (lo+hi+1)/2;
+		if (file->extents[mid].offset <= offset)
+			lo = mid;
+		else
+			hi = mid-1;
+	}
+	file->cur_extent = lo;
+	return &file->extents[lo];
+}
+
+/*
+ * Locate the chunk of the file starting at offset: up to a buffer full,
+ * as long as it's contiguous on the disk. Returns the number of bytes of
+ * the file it holds, and sets *bytes_to_read to that rounded up to whole
+ * blocks so that even the tail of a file is eligible for direct IO.
+ * Clusters are a whole number of blocks, so this never runs past the end
+ * of the extent.
+ */
+static int
+file_chunk(FileHandle *file, uint64_t offset, int *cluster, int *cluster_offset, int *bytes_to_read)
+{
+	FSInfo *fs = file->fs;
+	Extent *e = file_extent(file, offset);
+	uint64_t in_extent = offset - e->offset;
+	int bytes;
+
+	*cluster = e->cluster + in_extent / fs->bytes_per_cluster;
+	*cluster_offset = in_extent % fs->bytes_per_cluster;
+	bytes = MIN(file->buffer_size, e->bytes - in_extent);
+	*bytes_to_read = (bytes+fs->block_size-1) & ~(fs->block_size-1);
+	return bytes;
+}
+
+/*
+ * Once a file has been read sequentially for a couple of chunks, ask the
+ * block IO layer to start reading the next few chunks in the background,
+ * following the cluster chain. Directories are small, and read through
+ * the metadata cache, so this is only worth doing for file data.
+ */
+static void
+file_readahead(FileHandle *file, uint64_t bytes)
+{
+	uint64_t limit;
+	int cluster;
+	int cluster_offset;
+	int bytes_to_read;
+
+	if (file->offset != file->readahead_last)
+	{
+		file->sequential = 0;
+		file->readahead_next = 0;
+	}
+	file->sequential++;
+	file->readahead_last = file->offset + bytes;
+	if (file->sequential < FILE_READAHEAD_AFTER)
+		return;
+
+	limit = file->readahead_last + (uint64_t)FILE_READAHEAD_CHUNKS*file->buffer_size;
+	if (file->readahead_next < file->readahead_last)
+		file->readahead_next = file->readahead_last;
+	while (file->readahead_next < limit && file->readahead_next < file->filesize)
+	{
+		file->readahead_next += file_chunk(file, file->readahead_next,
+				&cluster, &cluster_offset, &bytes_to_read);
+		fs_prefetch(file->fs, cluster, cluster_offset, bytes_to_read);
+	}
+}
+
+/*
+ * A directory's size comes from its '.' entry, the first in the
+ * directory, so fix it up once that has been read.
+ */
+static void
+file_fixup_size(FileHandle *file, DirEntry *dot)
+{
+	uint64_t new_size = fs_dir_entry_size(file->fs, dot);
+
+	file->filesize = fs_extents_set_size(file->fs, file->extents, file->num_extents, new_size);
+	file->filesize_needs_fixup = 0;
+}
+
+/*
+ * Read the next chunk of the file into buf, which must hold
+ * file->buffer_size bytes. Unless swap is set file data is left as it is
+ * on the disk, for the caller to pass to fs_swap_bytes(); directories are
+ * always swapped. Returns the number of bytes of the file in buf, 0 at
+ * the end of the file, or -1 if the read failed.
+ */
+int
+file_read_buffer(FileHandle *file, char *buf, int swap)
 {
-	char *buffer = file_buffer_alloc(file);
-	int cluster_index;
 	int cluster;
 	int cluster_offset;
 	int bytes;
 	int bytes_to_read;
-	int bytes_left;
+	void *r;
 
 	if (file->offset >= file->filesize)
 		return 0;
 
-	cluster_index = file->offset / file->fs->bytes_per_cluster;
-	cluster = file->clusters[cluster_index].cluster;
-	cluster_offset = file->offset % file->fs->bytes_per_cluster;
-	bytes = MIN(file->buffer_size, file->filesize-file->offset);
-	bytes_to_read = (bytes+3) & ~0x3;
+	bytes = file_chunk(file, file->offset, &cluster, &cluster_offset, &bytes_to_read);
 
-	if (!fs_read(file->fs, buffer, cluster, cluster_offset, bytes_to_read))
+	if (file->is_dir)
+		r = fs_read(file->fs, buf, cluster, cluster_offset, bytes_to_read, FS_READ_DIR);
+	else
 	{
-		file->nread = 0;
-		return 0;
+		file_readahead(file, bytes);
+		if (swap)
+			r = fs_read(file->fs, buf, cluster, cluster_offset, bytes_to_read, FS_READ_DATA);
+		else
+			r = fs_read_raw(file->fs, buf, cluster, cluster_offset, bytes_to_read);
 	}
+	if (!r)
+		return -1;
 
 	if (file->filesize_needs_fixup)
 	{
-		DirEntry *dot;
-		int clusters;
-		int unused;
-		int new_size;
-
-		dot = (DirEntry *)buffer;
-		clusters = be32toh(dot->clusters);
-		unused = be32toh(dot->unused_bytes_in_last_cluster);
-		new_size = clusters*file->fs->bytes_per_cluster - unused;
-		file->clusters[file->num_clusters-1].bytes_used -= (file->filesize - new_size);
-		file->filesize = new_size;
-		bytes = MIN(new_size, bytes);
-		file->filesize_needs_fixup = 0;
+		file_fixup_size(file, (DirEntry *)buf);
+		bytes = MIN(file->filesize, bytes);
+	}
+	file->offset += bytes;
+	return bytes;
+}
+
+/*
+ * Read bytes from a run of the disk that the caller knows is
+ * contiguous, into buf. Whole blocks go straight into buf; a block that
+ * is only partly wanted, at either end, is read into a spare block and
+ * the wanted part copied out.
+ */
+static int
+file_read_span(FileHandle *file, char *buf, int cluster, uint64_t span_offset, uint64_t bytes, int swap)
+{
+	FSInfo *fs = file->fs;
+	FSReadKind kind = file->is_dir? FS_READ_DIR : FS_READ_DATA;
+	uint64_t head = span_offset % fs->block_size;
+	uint64_t n;
+	char *block = 0;
+	void *r = buf;
+
+	cluster += span_offset / fs->bytes_per_cluster;
+	span_offset %= fs->bytes_per_cluster;
+
+	while (bytes > 0 && r)
+	{
+		if (head > 0 || bytes < fs->block_size)
+		{
+			if (!block && (block = blkio_buffer_alloc(fs->disk->dev, fs->block_size)) == 0)
+			{
+				no_memory("file_read_into");
+				return 0;
+			}
+			n = MIN(fs->block_size-head, bytes);
+			if (swap || file->is_dir)
+				r = fs_read(fs, block, cluster, span_offset-head, fs->block_size, kind);
+			else
+				r = fs_read_raw(fs, block, cluster, span_offset-head, fs->block_size);
+			/* Raw data is swapped a word at a time, so copy whole words. */
+			memcpy(buf, block+head, swap || file->is_dir? n : MIN((n+3) & ~3, fs->block_size-head));
+			head = 0;
+		}
+		else
+		{
+			n = MIN(bytes, FILE_READ_INTO_MAX) & ~(uint64_t)(fs->block_size-1);
+			if (swap || file->is_dir)
+				r = fs_read(fs, buf, cluster, span_offset, n, kind);
+			else
+				r = fs_read_raw(fs, buf, cluster, span_offset, n);
+		}
+		buf += n;
+		bytes -= n;
+		cluster += (span_offset+n) / fs->bytes_per_cluster;
+		span_offset = (span_offset+n) % fs->bytes_per_cluster;
+	}
+
+	if (block)
+		blkio_buffer_free(fs->disk->dev, block, fs->block_size);
+	return r != 0;
+}
+
+/*
+ * Read up to size bytes of the file, from where the last read left off,
+ * into a buffer the caller owns. The buffer can be any size: each run of
+ * contiguous clusters that falls within it is read with as few requests
+ * as fs_read() allows, so a big buffer means big reads. Unless swap is
+ * set file data is left as it is on the disk, in which case the offset
+ * and size should be multiples of 4 so that the caller can swap whole
+ * words; the file's last word is then copied whole, so buf needs room
+ * for up to 3 bytes more than the file holds. Returns the number of
+ * bytes read, 0 at the end of the file or -1 if a read failed.
+ *
+ * There's no readahead here: the block IO layer only serves a read from
+ * a single prefetched chunk, so reads this big would never hit and every
+ * byte would come off the disk twice. Callers wanting the disk kept busy
+ * read in one thread and process in another, as cp does.
+ */
+int64_t
+file_read_into(FileHandle *file, char *buf, uint64_t size, int swap)
+{
+	uint64_t start = file->offset;
+	uint64_t done = 0;
+	uint64_t in_extent;
+	uint64_t bytes;
+	Extent *e;
+
+	if (file->offset >= file->filesize)
+		return 0;
+
+	size = MIN(size, file->filesize - file->offset);
+	while (done < size)
+	{
+		e = file_extent(file, file->offset);
+		in_extent = file->offset - e->offset;
+		bytes = MIN(e->bytes - in_extent, size - done);
+		if (!file_read_span(file, buf+done, e->cluster, in_extent, bytes, swap))
+			return -1;
+		done += bytes;
+		file->offset += bytes;
+	}
+
+	if (file->filesize_needs_fixup && start == 0 && done >= sizeof(DirEntry))
+	{
+		file_fixup_size(file, (DirEntry *)buf);
+		if (file->offset > file->filesize)
+		{
+			done -= file->offset - file->filesize;
+			file->offset = file->filesize;
+		}
+	}
+	return done;
+}
+
+/*
+ * Build the table file_pread() uses to go straight from a cluster's
+ * position in the file to the extent holding it. A file in one piece
+ * doesn't need one. The first file_pread() builds it; the lock keeps
+ * threads sharing the handle from building it twice.
+ */
+static int *
+file_extent_of(FileHandle *file)
+{
+	int *extent_of;
+	int clusters = 0;
+	int i;
+	int c;
+
+	mutex_lock(&file->lock);
+	if ((extent_of = file->extent_of) == 0)
+	{
+		for (i = 0; i < file->num_extents; i++)
+			clusters += file->extents[i].clusters;
+		if ((extent_of = malloc((size_t)clusters*sizeof(int))) == 0)
+		{
+			no_memory("file_pread");
+		}
+		else
+		{
+			for (i = 0, c = 0; i < file->num_extents; i++)
+				for (clusters = 0; clusters < file->extents[i].clusters; clusters++)
+					extent_of[c++] = i;
+			file->extent_of = extent_of;
+		}
+	}
+	mutex_unlock(&file->lock);
+	return extent_of;
+}
+
+/*
+ * Read up to len bytes of the file starting at offset into buf, without
+ * disturbing where file_read() and friends are up to. The offset's
+ * extent is found by dividing by the cluster size and looking it up, so
+ * reading a recording's header, tail or a window in the middle costs the
+ * same. Several threads can read through one handle at once. Data is
+ * always swapped. A directory's size isn't fixed up from its '.' entry,
+ * so read directories with file_read() first. Returns the number of
+ * bytes read, 0 at or beyond the end of the file, or -1 if a read failed.
+ */
+int64_t
+file_pread(FileHandle *file, char *buf, uint64_t offset, uint64_t len)
+{
+	int *extent_of = 0;
+	uint64_t done = 0;
+	uint64_t in_extent;
+	uint64_t bytes;
+	Extent *e;
+
+	if (offset >= file->filesize)
+		return 0;
+	if (file->num_extents > 1 && (extent_of = file_extent_of(file)) == 0)
+		return -1;
+
+	len = MIN(len, file->filesize - offset);
+	while (done < len)
+	{
+		e = &file->extents[extent_of? extent_of[offset/file->fs->bytes_per_cluster] : 0];
+		in_extent = offset - e->offset;
+		bytes = MIN(e->bytes - in_extent, len - done);
+		if (!file_read_span(file, buf+done, e->cluster, in_extent, bytes, 1))
+			return -1;
+		done += bytes;
+		offset += bytes;
 	}
-	file->nread = bytes;
+	return done;
+}
+
+/*
+ * For callers doing their own block IO, as cp does: find where the file
+ * goes on from where the last read left off, up to max bytes as long as
+ * they're contiguous on the disk, and move past them. Sets *cluster and
+ * *cluster_offset as fs_read() takes them and returns the number of bytes
+ * of the file there, or 0 at the end of the file. The data on the disk
+ * needs fs_swap_bytes(). Not for directories, whose size isn't known
+ * until they've been read.
+ */
+uint64_t
+file_next_span(FileHandle *file, uint64_t max, int *cluster, int *cluster_offset)
+{
+	FSInfo *fs = file->fs;
+	uint64_t in_extent;
+	uint64_t bytes;
+	Extent *e;
+
+	if (file->offset >= file->filesize)
+		return 0;
+
+	e = file_extent(file, file->offset);
+	in_extent = file->offset - e->offset;
+	*cluster = e->cluster + in_extent / fs->bytes_per_cluster;
+	*cluster_offset = in_extent % fs->bytes_per_cluster;
+	bytes = MIN(e->bytes - in_extent, max);
 	file->offset += bytes;
+	return bytes;
+}
+
+char *
+file_read(FileHandle *file)
+{
+	char *buffer = file_buffer_alloc(file);
+
+	if (!buffer || (file->nread = file_read_buffer(file, buffer, 1)) <= 0)
+	{
+		file->nread = 0;
+		return 0;
+	}
 	return buffer;
 }
+
+/*
+ * Number of blocks of the file that couldn't be read from the disk.
+ */
+uint64_t
+file_bad_blocks(FileHandle *file)
+{
+	uint64_t bad = 0;
+	int i;
+
+	for (i = 0; i < file->num_extents; i++)
+		bad += fs_bad_blocks(file->fs, file->extents[i].cluster, 0,
+				file->extents[i].bytes);
+	return bad;
+}
@@ -0,0 +1,159 @@
+/*
+ * Report on free space and fragmentation.
+ *
+ * Copyright 2010 Mark H. Wilkinson
+ *
+ * This file is part of HDSave.
+ *
+ * HDSave is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HDSave is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HDSave.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "port.h"
+#include "common.h"
+#include "blkio.h"
+#include "fs.h"
+
+/*
+ * A rough model of the disk: each extent after the first costs a seek
+ * of average length plus half a turn, and the data comes off at about
+ * what a USB caddy manages. A file is slow to extract if seeking adds
+ * more than FRAG_SLOW_PERCENT to the time spent reading it.
+ */
+#define FRAG_SEEK_MS		12.0
+#define FRAG_READ_MB_PER_S	50.0
+#define FRAG_SLOW_PERCENT	10
+
+typedef struct {
+	int all;
+	int header;
+	int files;
+	int extents;
+	int single;
+	int slow;
+	int worst;
+	char *worst_path;
+	double seek_ms;
+} Frag;
+
+static int
+fs_frag_walk_fn(void *arg, FSWalkEvent event, char *path, DirEntry *entry, FileHandle *file)
+{
+	Frag *frag = (Frag *)arg;
+	double seek_ms;
+	double read_ms;
+	int slow;
+
+	if (event != FS_WALK_FILE)
+		return 1;
+
+	seek_ms = (file->num_extents > 1? file->num_extents-1 : 0)*FRAG_SEEK_MS;
+	read_ms = file->filesize/(FRAG_READ_MB_PER_S*1000);
+	slow = seek_ms > 0 && seek_ms*100 > read_ms*FRAG_SLOW_PERCENT;
+
+	frag->files++;
+	frag->extents += file->num_extents;
+	frag->seek_ms += seek_ms;
+	if (file->num_extents <= 1)
+		frag->single++;
+	if (slow)
+		frag->slow++;
+	if (file->num_extents > frag->worst)
+	{
+		free(frag->worst_path);
+		if ((frag->worst_path = strdup(path)) == 0)
+		{
+			no_memory("fs_frag");
+			return 0;
+		}
+		frag->worst = file->num_extents;
+	}
+
+	if (!frag->all && file->num_extents <= 1)
+		return 1;
+	if (!frag->header)
+	{
+		printf("%8s %8s %8s  %s\n", "extents", "size", "seek ms", "file");
+		frag->header = 1;
+	}
+	printf("%8d %8s %8.0f  %s%s\n", file->num_extents, format_disk_size(file->filesize),
+			seek_ms, path, slow? "  (slow)" : "");
+	return 1;
+}
+
+static void
+fs_frag_free_space(FSInfo *fs, FSFatUsage *usage)
+{
+	char runs[24];
+	int b;
+
+	printf("Disk: %d of %d clusters used, %s per cluster\n",
+			usage->clusters-usage->free_clusters, usage->clusters,
+			format_disk_size(fs->bytes_per_cluster));
+	printf("Free space: %d clusters", usage->free_clusters);
+	printf(" (%s) in %d runs,", format_disk_size((uint64_t)usage->free_clusters*fs->bytes_per_cluster),
+			usage->free_runs);
+	printf(" largest %d clusters\n", usage->largest_free_run);
+
+	if (usage->free_runs == 0)
+		return;
+	printf("  %12s %8s %8s\n", "run length", "runs", "space");
+	for (b = 0; b < FS_FREE_RUN_BUCKETS; b++)
+	{
+		if (usage->free_run_hist[b] == 0)
+			continue;
+		if (b == 0)
+			snprintf(runs, sizeof(runs), "1");
+		else
+			snprintf(runs, sizeof(runs), "%d-%d", 1 << b, (2 << b)-1);
+		printf("  %12s %8d %8s\n", runs, usage->free_run_hist[b],
+				format_disk_size((uint64_t)usage->free_run_clusters[b]*fs->bytes_per_cluster));
+	}
+}
+
+/*
+ * Print fragmented files (or all of them), then a summary of free space
+ * and fragmentation. The FAT has already been decomposed into extents by
+ * the time the files are opened, so this costs one pass over the FAT for
+ * free space plus a walk of the directories.
+ */
+int
+fs_frag(FSInfo *fs, int all)
+{
+	FSFatUsage usage;
+	Frag frag;
+
+	memset(&frag, 0, sizeof(frag));
+	frag.all = all;
+	if (!fs_walk(fs, fs_frag_walk_fn, &frag) || !fs_fat_usage(fs, &usage))
+	{
+		free(frag.worst_path);
+		return 0;
+	}
+
+	if (frag.header)
+		printf("\n");
+	fs_frag_free_space(fs, &usage);
+	printf("Files: %d in %d extents, %d in a single extent", frag.files, frag.extents, frag.single);
+	if (frag.worst > 1)
+		printf(", most %d (%s)", frag.worst, frag.worst_path);
+	printf("\n");
+	printf("Seeking adds about %.1fs to copying every file; %d file%s slow to extract\n",
+			frag.seek_ms/1000, frag.slow, frag.slow == 1? " is" : "s are");
+
+	free(frag.worst_path);
+	return 1;
+}
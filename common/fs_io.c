@@ -19,15 +19,27 @@
  * along with HDSave.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdio.h>
+#include <string.h>
+
 #include "port.h"
 #include "common.h"
 #include "blkio.h"
 #include "fs.h"
+#include "stats.h"
 
-void *
-fs_read(FSInfo *fs, void *buf, int cluster, int cluster_offset, int bytes)
+/*
+ * Metadata reads are looked up in, and added to, the disk's cache. File
+ * data streams straight past it: recordings are far bigger than any cache
+ * we could keep and are rarely read twice.
+ */
+static void *
+fs_read_swap(FSInfo *fs, void *buf, int cluster, int cluster_offset, int bytes, FSReadKind kind, int swap)
 {
 	off_t offset;
+	void *mapped;
+	int cacheable;
+	uint64_t start = stats_start();
 
 	if (cluster < -1)
 	{
@@ -49,24 +61,90 @@ fs_read(FSInfo *fs, void *buf, int cluster, int cluster_offset, int bytes)
 	}
 
 	offset = (off_t)(cluster+1)*fs->bytes_per_cluster+cluster_offset;
-	if (blkio_read(fs->disk->dev, buf, offset, bytes) == -1)
+	cacheable = kind != FS_READ_DATA && swap;
+
+	if (cacheable && fs_cache_lookup(fs->disk->cache, buf, offset, bytes))
 	{
-		return 0;
+		stats_fs_read(start, kind, bytes, 1, 1);
+		return buf;
+	}
+
+	/*
+	 * If the device is mapped into memory, the byte swap we have to do
+	 * anyway doubles as the copy into the caller's buffer.
+	 */
+	if ((mapped = blkio_map(fs->disk->dev, offset, bytes)) != 0)
+	{
+		if (swap)
+			fs_swap_bytes_copy(buf, mapped, bytes);
+		else
+			memcpy(buf, mapped, bytes);
+	}
+	else
+	{
+		if (blkio_read(fs->disk->dev, buf, offset, bytes) == -1)
+		{
+			stats_fs_read(start, kind, bytes, 0, 0);
+			return 0;
+		}
+
+		if (swap)
+			fs_swap_bytes(buf, bytes);
 	}
 
-	fs_swap_bytes(buf, bytes);
+	if (cacheable)
+		fs_cache_insert(fs->disk->cache, buf, offset, bytes);
 
+	stats_fs_read(start, kind, bytes, 0, 1);
 	return buf;
 }
 
+void *
+fs_read(FSInfo *fs, void *buf, int cluster, int cluster_offset, int bytes, FSReadKind kind)
+{
+	return fs_read_swap(fs, buf, cluster, cluster_offset, bytes, kind, 1);
+}
+
+/*
+ * Read file data as it is on the disk, leaving the caller to call
+ * fs_swap_bytes() when it's ready to. This lets a copy do the swap on
+ * whichever thread has time for it.
+ */
+void *
+fs_read_raw(FSInfo *fs, void *buf, int cluster, int cluster_offset, int bytes)
+{
+	return fs_read_swap(fs, buf, cluster, cluster_offset, bytes, FS_READ_DATA, 0);
+}
+
+/*
+ * Where a cluster's data is on the device, for callers doing their own
+ * block IO.
+ */
+uint64_t
+fs_disk_offset(FSInfo *fs, int cluster, int cluster_offset)
+{
+	return (uint64_t)(cluster+1)*fs->bytes_per_cluster+cluster_offset;
+}
+
+/*
+ * Hint that a read of file data will follow soon.
+ */
 void
-fs_swap_bytes(void *buf, int bytes)
+fs_prefetch(FSInfo *fs, int cluster, int cluster_offset, int bytes)
 {
-	uint32_t *s = (uint32_t *)buf;
-	uint32_t *e = (uint32_t *)(buf+bytes);
+	uint64_t offset = (uint64_t)(cluster+1)*fs->bytes_per_cluster+cluster_offset;
 
-	while (s < e) {
-		*s = bswap_32(*s);
-		s++;
-	}
+	blkio_prefetch(fs->disk->dev, offset, bytes);
+}
+
+/*
+ * Number of blocks in the range that the block IO layer couldn't read
+ * and replaced with zeros.
+ */
+uint64_t
+fs_bad_blocks(FSInfo *fs, int cluster, int cluster_offset, uint64_t bytes)
+{
+	uint64_t offset = (uint64_t)(cluster+1)*fs->bytes_per_cluster+cluster_offset;
+
+	return blkio_bad_blocks(fs->disk->dev, offset, bytes);
 }
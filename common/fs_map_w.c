@@ -21,6 +21,7 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <sys/param.h>
 
 #include "port.h"
 #include "common.h"
@@ -56,67 +57,65 @@ map_close()
 	map = 0;
 }
 
+/*
+ * The map format lists every cluster with the number of bytes used in
+ * it, so expand the extents.
+ */
 static void
 map_clusters(FileHandle *f)
 {
+	int bytes_per_cluster = f->fs->bytes_per_cluster;
+	Extent *e;
+	uint64_t left;
+	int bytes_used;
+	int i;
 	int c;
 
-	for (c = 0; c < f->num_clusters; c++)
+	for (i = 0; i < f->num_extents; i++)
 	{
-		if (c > 0)
-			map_printf(",");
-		map_printf("[%" PRId32 ",%" PRId32 "]", f->clusters[c].cluster, f->clusters[c].bytes_used);
+		e = &f->extents[i];
+		left = e->bytes;
+		for (c = 0; c < e->clusters; c++)
+		{
+			bytes_used = MIN(bytes_per_cluster, left);
+			left -= bytes_used;
+			if (i > 0 || c > 0)
+				map_printf(",");
+			map_printf("[%" PRId32 ",%" PRId32 "]", e->cluster+c, bytes_used);
+		}
 	}
 }
 
-static int walk_dir(FileHandle *dir);
+static void
+map_report_bad_blocks(FileHandle *f, DirEntry *entry)
+{
+	uint64_t bad;
+
+	if ((bad = file_bad_blocks(f)) > 0)
+		fs_warn("%s: %" PRIu64 " unreadable blocks", entry->filename, bad);
+}
 
 static int
-walk_dir_entry(FileHandle *dir, void *arg, DirEntry *entry, int index)
+map_walk_fn(void *arg, FSWalkEvent event, char *path, DirEntry *entry, FileHandle *file)
 {
-	FileHandle *file;
+	/* The root directory is implied. */
+	if (entry == 0)
+		return 1;
 
-	switch (entry->type)
+	switch (event)
 	{
-	case DIR_ENTRY_UNUSED:
-	case DIR_ENTRY_DOT_DOT:
-	case DIR_ENTRY_DOT:
-	case DIR_ENTRY_RECYCLE:
-		break;
-	case DIR_ENTRY_FILEA:
-	case DIR_ENTRY_FILET:
+	case FS_WALK_FILE:
 		map_printf("%s: ", entry->filename);
-		if ((file = file_open_dir_entry(dir, entry)) == 0)
-			return 0;
 		map_clusters(file);
-		file_close(file);
+		map_report_bad_blocks(file, entry);
 		map_printf("\n");
 		break;
-	case DIR_ENTRY_SUBDIR:
+	case FS_WALK_DIR:
 		map_printf("%s: {\n", entry->filename);
-		if ((file = file_open_dir_entry(dir, entry)) == 0)
-			return 0;
-		if (!walk_dir(file))
-			return 0;
-		file_close(file);
+		break;
+	case FS_WALK_DIR_END:
 		map_printf("}\n");
 		break;
-	default:
-		fs_error("unrecognised directory entry type %d", entry->type);
-		return 0;
-	}
-	return 1;
-}
-
-static int
-walk_dir(FileHandle *dir)
-{
-	DirEntry *bad;
-
-	if ((bad = fs_dir_each_entry(dir, walk_dir_entry, 0)) != 0)
-	{
-		fprintf(stderr, "fs_walk_dir failed at %s\n", bad->filename);
-		return 0;
 	}
 	return 1;
 }
@@ -124,15 +123,9 @@ walk_dir(FileHandle *dir)
 int
 map_write(FSInfo *fs, char *path)
 {
-	FileHandle *root;
-	FileHandle *bad;
-
 	if (!map_open_write(path))
 		return 0;
-	if ((root = file_open_root(fs)) == 0)
-		return 0;
-	walk_dir(root);
-	file_close(root);
+	fs_walk(fs, map_walk_fn, 0);
 	map_close();
 	return 1;
 }
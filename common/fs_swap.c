@@ -0,0 +1,277 @@
+/*
+ * Byte swapping of data read from a Topfield disk.
+ *
+ * Copyright 2010 Mark H. Wilkinson
+ *
+ * This file is part of HDSave.
+ *
+ * HDSave is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HDSave is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HDSave.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "port.h"
+#include "common.h"
+#include "blkio.h"
+#include "fs.h"
+
+/*
+ * Everything on the disk is stored as byte swapped 32-bit words, so every
+ * byte fs_read() returns passes through here, including every byte of
+ * every recording we copy. On x86 the work is done 16 or 32 bytes at a
+ * time with a byte shuffle (SSSE3 or AVX2), chosen on the first call by
+ * asking the CPU what it supports. ARM builds with NEON use its 32-bit
+ * byte reverse. Anything else, and any tail shorter than a vector, gets
+ * the plain loop.
+ *
+ * The buffers needn't be aligned, and swapping in place is just a copy
+ * onto itself.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FS_SWAP_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define FS_SWAP_NEON
+#include <arm_neon.h>
+#endif
+
+typedef void (*SwapFn)(void *dst, void *src, int bytes);
+
+static void
+fs_swap_scalar(void *dst, void *src, int bytes)
+{
+	uint32_t *d = (uint32_t *)dst;
+	uint32_t *s = (uint32_t *)src;
+	uint32_t *e = (uint32_t *)(src+bytes);
+
+	while (s < e) {
+		*d++ = bswap_32(*s);
+		s++;
+	}
+}
+
+#ifdef FS_SWAP_X86
+
+__attribute__((target("ssse3")))
+static void
+fs_swap_ssse3(void *dst, void *src, int bytes)
+{
+	__m128i mask = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	char *d = dst;
+	char *s = src;
+	int i = 0;
+
+	for (; i+64 <= bytes; i += 64)
+	{
+		__m128i a = _mm_loadu_si128((__m128i *)(s+i));
+		__m128i b = _mm_loadu_si128((__m128i *)(s+i+16));
+		__m128i c = _mm_loadu_si128((__m128i *)(s+i+32));
+		__m128i e = _mm_loadu_si128((__m128i *)(s+i+48));
+
+		_mm_storeu_si128((__m128i *)(d+i), _mm_shuffle_epi8(a, mask));
+		_mm_storeu_si128((__m128i *)(d+i+16), _mm_shuffle_epi8(b, mask));
+		_mm_storeu_si128((__m128i *)(d+i+32), _mm_shuffle_epi8(c, mask));
+		_mm_storeu_si128((__m128i *)(d+i+48), _mm_shuffle_epi8(e, mask));
+	}
+	for (; i+16 <= bytes; i += 16)
+		_mm_storeu_si128((__m128i *)(d+i),
+				_mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(s+i)), mask));
+	fs_swap_scalar(d+i, s+i, bytes-i);
+}
+
+/* The AVX2 shuffle works within each 16 byte half, which is all we need. */
+__attribute__((target("avx2")))
+static void
+fs_swap_avx2(void *dst, void *src, int bytes)
+{
+	__m256i mask = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+			12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	char *d = dst;
+	char *s = src;
+	int i = 0;
+
+	for (; i+128 <= bytes; i += 128)
+	{
+		__m256i a = _mm256_loadu_si256((__m256i *)(s+i));
+		__m256i b = _mm256_loadu_si256((__m256i *)(s+i+32));
+		__m256i c = _mm256_loadu_si256((__m256i *)(s+i+64));
+		__m256i e = _mm256_loadu_si256((__m256i *)(s+i+96));
+
+		_mm256_storeu_si256((__m256i *)(d+i), _mm256_shuffle_epi8(a, mask));
+		_mm256_storeu_si256((__m256i *)(d+i+32), _mm256_shuffle_epi8(b, mask));
+		_mm256_storeu_si256((__m256i *)(d+i+64), _mm256_shuffle_epi8(c, mask));
+		_mm256_storeu_si256((__m256i *)(d+i+96), _mm256_shuffle_epi8(e, mask));
+	}
+	for (; i+32 <= bytes; i += 32)
+		_mm256_storeu_si256((__m256i *)(d+i),
+				_mm256_shuffle_epi8(_mm256_loadu_si256((__m256i *)(s+i)), mask));
+	fs_swap_scalar(d+i, s+i, bytes-i);
+}
+
+#endif
+
+#ifdef FS_SWAP_NEON
+
+static void
+fs_swap_neon(void *dst, void *src, int bytes)
+{
+	uint8_t *d = dst;
+	uint8_t *s = src;
+	int i = 0;
+
+	for (; i+64 <= bytes; i += 64)
+	{
+		uint8x16_t a = vld1q_u8(s+i);
+		uint8x16_t b = vld1q_u8(s+i+16);
+		uint8x16_t c = vld1q_u8(s+i+32);
+		uint8x16_t e = vld1q_u8(s+i+48);
+
+		vst1q_u8(d+i, vrev32q_u8(a));
+		vst1q_u8(d+i+16, vrev32q_u8(b));
+		vst1q_u8(d+i+32, vrev32q_u8(c));
+		vst1q_u8(d+i+48, vrev32q_u8(e));
+	}
+	for (; i+16 <= bytes; i += 16)
+		vst1q_u8(d+i, vrev32q_u8(vld1q_u8(s+i)));
+	fs_swap_scalar(d+i, s+i, bytes-i);
+}
+
+#endif
+
+/*
+ * Pick the best version this CPU supports. Two threads racing through
+ * here both store the same answer.
+ */
+static SwapFn
+fs_swap_choose(void)
+{
+#ifdef FS_SWAP_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return fs_swap_avx2;
+	if (__builtin_cpu_supports("ssse3"))
+		return fs_swap_ssse3;
+#endif
+#ifdef FS_SWAP_NEON
+	return fs_swap_neon;
+#endif
+	return fs_swap_scalar;
+}
+
+static void fs_swap_first(void *dst, void *src, int bytes);
+
+static SwapFn fs_swap = fs_swap_first;
+
+static void
+fs_swap_first(void *dst, void *src, int bytes)
+{
+	fs_swap = fs_swap_choose();
+	fs_swap(dst, src, bytes);
+}
+
+void
+fs_swap_bytes(void *buf, int bytes)
+{
+	fs_swap(buf, buf, bytes);
+}
+
+void
+fs_swap_bytes_copy(void *dst, void *src, int bytes)
+{
+	fs_swap(dst, src, bytes);
+}
+
+#ifdef TEST
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_BYTES (64*1024*1024)
+#define BENCH_ROUNDS 20
+
+static void
+copy(void *dst, void *src, int bytes)
+{
+	memcpy(dst, src, bytes);
+}
+
+static void
+bench(char *name, SwapFn fn, SwapFn ref, char *dst, char *src, char *expect)
+{
+	char want[512];
+	clock_t start;
+	double secs;
+	int i, j;
+
+	/*
+	 * Every length up to 256 bytes at every alignment of the source and
+	 * destination first, against the reference. Lengths are whole words,
+	 * as they always are from the callers.
+	 */
+	for (i = 0; i <= 256; i += 4)
+		for (j = 0; j < 16; j++)
+		{
+			ref(want, src+15-j, i);
+			memset(dst, 0, 512);
+			fn(dst+j, src+15-j, i);
+			if (memcmp(dst+j, want, i) != 0 || dst[j+i] != 0 || (j > 0 && dst[j-1] != 0))
+			{
+				printf("%-8s FAILED at %d bytes, offset %d\n", name, i, j);
+				return;
+			}
+		}
+
+	start = clock();
+	for (i = 0; i < BENCH_ROUNDS; i++)
+		fn(dst, src, BENCH_BYTES);
+	secs = (double)(clock()-start)/CLOCKS_PER_SEC;
+	if (memcmp(dst, expect, BENCH_BYTES) != 0)
+	{
+		printf("%-8s FAILED\n", name);
+		return;
+	}
+	printf("%-8s %8.2f GB/s\n", name, (double)BENCH_BYTES*BENCH_ROUNDS/secs/1e9);
+}
+
+int
+main(void)
+{
+	char *src = malloc(BENCH_BYTES);
+	char *dst = malloc(BENCH_BYTES);
+	char *expect = malloc(BENCH_BYTES);
+	int i;
+
+	for (i = 0; i < BENCH_BYTES; i++)
+		src[i] = i*7+(i>>9);
+	fs_swap_scalar(expect, src, BENCH_BYTES);
+
+	bench("memcpy", copy, copy, dst, src, src);
+	bench("scalar", fs_swap_scalar, fs_swap_scalar, dst, src, expect);
+#ifdef FS_SWAP_X86
+	if (__builtin_cpu_supports("ssse3"))
+		bench("ssse3", fs_swap_ssse3, fs_swap_scalar, dst, src, expect);
+	if (__builtin_cpu_supports("avx2"))
+		bench("avx2", fs_swap_avx2, fs_swap_scalar, dst, src, expect);
+#endif
+#ifdef FS_SWAP_NEON
+	bench("neon", fs_swap_neon, fs_swap_scalar, dst, src, expect);
+#endif
+	bench("chosen", fs_swap_choose(), fs_swap_scalar, dst, src, expect);
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,317 @@
+/*
+ * Walk the whole directory tree, and find which file owns a cluster.
+ *
+ * Copyright 2010 Mark H. Wilkinson
+ *
+ * This file is part of HDSave.
+ *
+ * HDSave is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HDSave is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HDSave.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "port.h"
+#include "common.h"
+#include "blkio.h"
+#include "fs.h"
+
+#define FS_WALK_PATH_MAX 1024
+
+typedef struct {
+	FSWalkFn fn;
+	void *arg;
+	int len;
+	char path[FS_WALK_PATH_MAX];
+} Walk;
+
+static int fs_walk_dir(Walk *w, FileHandle *dir);
+
+static int
+fs_walk_entry(FileHandle *dir, void *arg, DirEntry *entry, int index)
+{
+	Walk *w = (Walk *)arg;
+	FileHandle *file;
+	int len = w->len;
+	int n;
+	int r;
+
+	switch (entry->type)
+	{
+	case DIR_ENTRY_UNUSED:
+	case DIR_ENTRY_DOT_DOT:
+	case DIR_ENTRY_DOT:
+	case DIR_ENTRY_RECYCLE:
+		return 1;
+	case DIR_ENTRY_FILEA:
+	case DIR_ENTRY_FILET:
+	case DIR_ENTRY_SUBDIR:
+		break;
+	default:
+		fs_error("unrecognised directory entry type %d", entry->type);
+		return 0;
+	}
+
+	n = snprintf(w->path+len, sizeof(w->path)-len, "/%.*s",
+			(int)sizeof(entry->filename), entry->filename);
+	if (n >= sizeof(w->path)-len)
+	{
+		w->path[len] = '\0';
+		fs_error("path too long in %s", w->path);
+		return 0;
+	}
+	w->len += n;
+
+	if ((file = file_open_dir_entry(dir, entry)) == 0)
+	{
+		r = 0;
+	}
+	else
+	{
+		if (entry->type == DIR_ENTRY_SUBDIR)
+			r = w->fn(w->arg, FS_WALK_DIR, w->path, entry, file)
+					&& fs_walk_dir(w, file)
+					&& w->fn(w->arg, FS_WALK_DIR_END, w->path, entry, file);
+		else
+			r = w->fn(w->arg, FS_WALK_FILE, w->path, entry, file);
+		file_close(file);
+	}
+
+	w->len = len;
+	w->path[len] = '\0';
+	return r;
+}
+
+static int
+fs_walk_dir(Walk *w, FileHandle *dir)
+{
+	DirEntry *bad;
+
+	if ((bad = fs_dir_each_entry(dir, fs_walk_entry, w)) != 0)
+	{
+		fprintf(stderr, "fs_walk_dir failed at %s\n", bad->filename);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Call fn for every file and directory on the disk, depth first, in
+ * directory order. Directories are reported before and after their
+ * contents; the root is reported too, with no DirEntry and path "/".
+ * The path and FileHandle are only valid during the call. Returns 0 if
+ * fn does, or if any part of the tree can't be read.
+ */
+int
+fs_walk(FSInfo *fs, FSWalkFn fn, void *arg)
+{
+	Walk w;
+	FileHandle *root;
+	int r;
+
+	if ((root = file_open_root(fs)) == 0)
+		return 0;
+
+	w.fn = fn;
+	w.arg = arg;
+	w.len = 0;
+	w.path[0] = '\0';
+	r = fn(arg, FS_WALK_DIR, "/", 0, root)
+			&& fs_walk_dir(&w, root)
+			&& fn(arg, FS_WALK_DIR_END, "/", 0, root);
+	file_close(root);
+	return r;
+}
+
+/*
+ * The reverse index. Each cluster on the disk leads to a list of the
+ * places it appears in a file: normally none or one, but a damaged FAT
+ * can cross-link chains so that several files share a cluster, and we
+ * want to know about all of them. Building it costs one walk of the
+ * tree; after that a query is a couple of array lookups.
+ */
+typedef struct {
+	int path;		/* index into FSOwners.paths */
+	int position;		/* cluster's position in the file */
+	uint64_t offset;	/* file offset of the cluster's first byte */
+	int next;		/* next owner of the same cluster, or -1 */
+} Owned;
+
+struct FSOwners {
+	FSInfo *fs;
+	int *first;		/* per cluster: first Owned, or -1 */
+	int num_clusters;
+	Owned *owned;
+	int num_owned;
+	int max_owned;
+	char **paths;
+	int num_paths;
+	int max_paths;
+};
+
+static int
+fs_owners_grow(void **array, int *max, int want, int size)
+{
+	void *p;
+	int n = *max? *max : 1024;
+
+	while (n < want)
+		n *= 2;
+	if (n == *max)
+		return 1;
+	if ((p = realloc(*array, (size_t)n*size)) == 0)
+	{
+		no_memory("fs_owners_grow");
+		return 0;
+	}
+	*array = p;
+	*max = n;
+	return 1;
+}
+
+static int
+fs_owners_add_cluster(FSOwners *o, int cluster, int position, uint64_t offset)
+{
+	Owned *own;
+	int max;
+	int i;
+
+	if (cluster < 0)
+		return 1;
+	if (cluster >= o->num_clusters)
+	{
+		max = o->num_clusters;
+		if (!fs_owners_grow((void **)&o->first, &max, cluster+1, sizeof(int)))
+			return 0;
+		for (i = o->num_clusters; i < max; i++)
+			o->first[i] = -1;
+		o->num_clusters = max;
+	}
+	if (!fs_owners_grow((void **)&o->owned, &o->max_owned, o->num_owned+1, sizeof(Owned)))
+		return 0;
+
+	own = &o->owned[o->num_owned];
+	own->path = o->num_paths-1;
+	own->position = position;
+	own->offset = offset;
+	own->next = -1;
+
+	/* Keep cross-linked owners in walk order. */
+	if ((i = o->first[cluster]) < 0)
+	{
+		o->first[cluster] = o->num_owned;
+	}
+	else
+	{
+		while (o->owned[i].next >= 0)
+			i = o->owned[i].next;
+		o->owned[i].next = o->num_owned;
+	}
+	o->num_owned++;
+	return 1;
+}
+
+static int
+fs_owners_walk_fn(void *arg, FSWalkEvent event, char *path, DirEntry *entry, FileHandle *file)
+{
+	FSOwners *o = (FSOwners *)arg;
+	Extent *e;
+	int position = 0;
+	int i;
+	int c;
+
+	if (event == FS_WALK_DIR_END)
+		return 1;
+
+	if (!fs_owners_grow((void **)&o->paths, &o->max_paths, o->num_paths+1, sizeof(char *)))
+		return 0;
+	if ((o->paths[o->num_paths] = strdup(path)) == 0)
+	{
+		no_memory("fs_owners_walk_fn");
+		return 0;
+	}
+	o->num_paths++;
+
+	for (i = 0; i < file->num_extents; i++)
+	{
+		e = &file->extents[i];
+		for (c = 0; c < e->clusters; c++)
+			if (!fs_owners_add_cluster(o, e->cluster+c, position++,
+					e->offset+(uint64_t)c*o->fs->bytes_per_cluster))
+				return 0;
+	}
+	return 1;
+}
+
+FSOwners *
+fs_owners_build(FSInfo *fs)
+{
+	FSOwners *o;
+
+	if ((o = calloc(1, sizeof(FSOwners))) == 0)
+	{
+		no_memory("fs_owners_build");
+		return 0;
+	}
+	o->fs = fs;
+
+	if (!fs_walk(fs, fs_owners_walk_fn, o))
+	{
+		fs_owners_close(o);
+		return 0;
+	}
+	return o;
+}
+
+/*
+ * Fill in up to max owners of cluster, returning how many there are in
+ * all.
+ */
+int
+fs_owners_lookup(FSOwners *o, int cluster, FSOwner *owners, int max)
+{
+	Owned *own;
+	int n = 0;
+	int i;
+
+	if (cluster < 0 || cluster >= o->num_clusters)
+		return 0;
+
+	for (i = o->first[cluster]; i >= 0; i = own->next, n++)
+	{
+		own = &o->owned[i];
+		if (n < max)
+		{
+			owners[n].path = o->paths[own->path];
+			owners[n].position = own->position;
+			owners[n].offset = own->offset;
+		}
+	}
+	return n;
+}
+
+void
+fs_owners_close(FSOwners *o)
+{
+	int i;
+
+	if (!o)
+		return;
+	for (i = 0; i < o->num_paths; i++)
+		free(o->paths[i]);
+	free(o->paths);
+	free(o->owned);
+	free(o->first);
+	free(o);
+}
@@ -0,0 +1,313 @@
+/*
+ * IO statistics.
+ *
+ * Copyright 2010 Mark H. Wilkinson
+ *
+ * This file is part of HDSave.
+ *
+ * HDSave is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HDSave is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HDSave.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "port.h"
+#include "common.h"
+#include "blkio.h"
+#include "fs.h"
+#include "stats.h"
+
+/*
+ * Latencies and seek distances are kept as log2 histograms. Latency
+ * bucket i counts operations that took less than 2^i microseconds (and
+ * at least half that); seek bucket i counts seeks of less than 2^i
+ * blocks. The last bucket of each takes everything bigger.
+ */
+#define STATS_BUCKETS 32
+
+typedef struct {
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t ns;
+	uint64_t max_ns;
+	uint64_t latency[STATS_BUCKETS];
+} StatsCounter;
+
+int stats_enabled;
+
+static mutex_t stats_lock;
+
+/* Indexed by FSReadKind. */
+static StatsCounter fs_stats[FS_READ_DATA+1];
+static uint64_t fs_cache_hits[FS_READ_DATA+1];
+static char *fs_kind_names[FS_READ_DATA+1] = {
+	"superblock",
+	"fat",
+	"directory",
+	"data",
+};
+
+static StatsCounter blkio_stats[STATS_SOURCES];
+static char *blkio_source_names[STATS_SOURCES] = {
+	"mapped",
+	"clone",
+	"readahead",
+	"rescue",
+	"device",
+};
+
+static StatsCounter device_stats;
+static uint64_t device_next;
+static uint64_t device_seeks;
+static uint64_t device_backward_seeks;
+static uint64_t device_seek_blocks;
+static uint64_t device_seek_hist[STATS_BUCKETS];
+
+void
+stats_enable(void)
+{
+	mutex_init(&stats_lock);
+	stats_enabled = 1;
+}
+
+static int
+stats_bucket(uint64_t value)
+{
+	int b = 0;
+
+	while (value > 0 && b < STATS_BUCKETS-1)
+	{
+		value >>= 1;
+		b++;
+	}
+	return b;
+}
+
+/*
+ * Call with the lock held.
+ */
+static void
+stats_count(StatsCounter *c, uint64_t start, uint64_t bytes, int ok)
+{
+	uint64_t ns = clock_ns() - start;
+
+	c->calls++;
+	if (!ok)
+		c->errors++;
+	c->bytes += bytes;
+	c->ns += ns;
+	if (ns > c->max_ns)
+		c->max_ns = ns;
+	c->latency[stats_bucket(ns/1000)]++;
+}
+
+void
+stats_fs_read(uint64_t start, int kind, int bytes, int cache_hit, int ok)
+{
+	if (!start || kind < 0 || kind > FS_READ_DATA)
+		return;
+
+	mutex_lock(&stats_lock);
+	stats_count(&fs_stats[kind], start, bytes, ok);
+	if (cache_hit)
+		fs_cache_hits[kind]++;
+	mutex_unlock(&stats_lock);
+}
+
+void
+stats_blkio_read(uint64_t start, StatsSource source, uint64_t count, int ok)
+{
+	if (!start)
+		return;
+
+	mutex_lock(&stats_lock);
+	stats_count(&blkio_stats[source], start, count, ok);
+	mutex_unlock(&stats_lock);
+}
+
+/*
+ * A seek is any read that doesn't start where the previous one ended.
+ * With readahead or several reading threads the reads reaching the disk
+ * are interleaved, and so are the seeks we count; that's what the disk
+ * sees too.
+ */
+void
+stats_device_read(uint64_t start, uint64_t offset, uint64_t count, int64_t result)
+{
+	uint64_t distance;
+
+	if (!start)
+		return;
+
+	mutex_lock(&stats_lock);
+	stats_count(&device_stats, start, result > 0? result : 0, result == count);
+	if (device_stats.calls > 1 && offset != device_next)
+	{
+		device_seeks++;
+		if (offset < device_next)
+		{
+			device_backward_seeks++;
+			distance = device_next - offset;
+		}
+		else
+		{
+			distance = offset - device_next;
+		}
+		device_seek_blocks += distance/512;
+		device_seek_hist[stats_bucket(distance/512)]++;
+	}
+	device_next = offset+count;
+	mutex_unlock(&stats_lock);
+}
+
+static int
+stats_last_bucket(uint64_t *hist)
+{
+	int last = -1;
+	int i;
+
+	for (i = 0; i < STATS_BUCKETS; i++)
+		if (hist[i])
+			last = i;
+	return last;
+}
+
+static void
+stats_print_hist_json(FILE *f, uint64_t *hist)
+{
+	int last = stats_last_bucket(hist);
+	int i;
+
+	fputc('[', f);
+	for (i = 0; i <= last; i++)
+		fprintf(f, "%s%" PRIu64, i? ", " : "", hist[i]);
+	fputc(']', f);
+}
+
+static void
+stats_print_counter_json(FILE *f, StatsCounter *c)
+{
+	fprintf(f, "\"calls\": %" PRIu64 ", \"errors\": %" PRIu64 ", \"bytes\": %" PRIu64
+			", \"time_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64 ", \"latency_us_log2\": ",
+			c->calls, c->errors, c->bytes, c->ns, c->max_ns);
+	stats_print_hist_json(f, c->latency);
+}
+
+static void
+stats_print_json(FILE *f, FSCacheStats *cs)
+{
+	int i;
+
+	fputs("{\n  \"fs_read\": {\n", f);
+	for (i = 0; i <= FS_READ_DATA; i++)
+	{
+		fprintf(f, "    \"%s\": { ", fs_kind_names[i]);
+		stats_print_counter_json(f, &fs_stats[i]);
+		fprintf(f, ", \"cache_hits\": %" PRIu64 " }%s\n", fs_cache_hits[i],
+				i < FS_READ_DATA? "," : "");
+	}
+	fputs("  },\n  \"blkio_read\": {\n", f);
+	for (i = 0; i < STATS_SOURCES; i++)
+	{
+		fprintf(f, "    \"%s\": { ", blkio_source_names[i]);
+		stats_print_counter_json(f, &blkio_stats[i]);
+		fprintf(f, " }%s\n", i < STATS_SOURCES-1? "," : "");
+	}
+	fputs("  },\n  \"device\": { ", f);
+	stats_print_counter_json(f, &device_stats);
+	fprintf(f, ", \"seeks\": %" PRIu64 ", \"backward_seeks\": %" PRIu64
+			", \"seek_blocks\": %" PRIu64 ", \"seek_blocks_log2\": ",
+			device_seeks, device_backward_seeks, device_seek_blocks);
+	stats_print_hist_json(f, device_seek_hist);
+	fprintf(f, " },\n  \"cache\": { \"hits\": %" PRIu64 ", \"misses\": %" PRIu64
+			", \"hit_bytes\": %" PRIu64 ", \"miss_bytes\": %" PRIu64
+			", \"inserts\": %" PRIu64 ", \"evictions\": %" PRIu64
+			", \"bytes\": %" PRIu64 " }\n}\n",
+			cs->hits, cs->misses, cs->hit_bytes, cs->miss_bytes,
+			cs->inserts, cs->evictions, cs->bytes);
+}
+
+static void
+stats_print_counter(FILE *f, char *name, StatsCounter *c)
+{
+	if (c->calls == 0)
+		return;
+	fprintf(f, "  %-12s %10" PRIu64 " %6" PRIu64 " %10s %10.3f %10.3f %10.3f\n",
+			name, c->calls, c->errors, format_disk_size(c->bytes),
+			c->ns/1e6, c->ns/1e3/c->calls, c->max_ns/1e3);
+}
+
+static void
+stats_print_hist(FILE *f, char *name, char *unit, uint64_t *hist)
+{
+	int last = stats_last_bucket(hist);
+	int i;
+
+	if (last < 0)
+		return;
+	fprintf(f, "  %s:\n", name);
+	for (i = 0; i <= last; i++)
+		if (hist[i])
+			fprintf(f, "    < %10" PRIu64 " %-6s %10" PRIu64 "\n",
+					(uint64_t)1 << i, unit, hist[i]);
+}
+
+static void
+stats_print_text(FILE *f, FSCacheStats *cs)
+{
+	char name[32];
+	int i;
+
+	fputs("IO statistics:\n", f);
+	fprintf(f, "  %-12s %10s %6s %10s %10s %10s %10s\n",
+			"", "calls", "errors", "bytes", "total ms", "mean us", "max us");
+	for (i = 0; i <= FS_READ_DATA; i++)
+	{
+		snprintf(name, sizeof(name), "fs %s", fs_kind_names[i]);
+		stats_print_counter(f, name, &fs_stats[i]);
+	}
+	for (i = 0; i < STATS_SOURCES; i++)
+	{
+		snprintf(name, sizeof(name), "blk %s", blkio_source_names[i]);
+		stats_print_counter(f, name, &blkio_stats[i]);
+	}
+	stats_print_counter(f, "device", &device_stats);
+
+	fprintf(f, "  metadata cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64
+			" evictions, %s held\n",
+			cs->hits, cs->misses, cs->evictions, format_disk_size(cs->bytes));
+	fprintf(f, "  seeks: %" PRIu64 " (%" PRIu64 " backward), %" PRIu64 " blocks in total\n",
+			device_seeks, device_backward_seeks, device_seek_blocks);
+
+	stats_print_hist(f, "device read latency", "us", device_stats.latency);
+	stats_print_hist(f, "seek distance", "blocks", device_seek_hist);
+}
+
+void
+stats_print(FILE *f, int json, FSCache *cache)
+{
+	FSCacheStats cs;
+
+	if (!stats_enabled)
+		return;
+
+	fs_cache_get_stats(cache, &cs);
+	mutex_lock(&stats_lock);
+	if (json)
+		stats_print_json(f, &cs);
+	else
+		stats_print_text(f, &cs);
+	mutex_unlock(&stats_lock);
+}
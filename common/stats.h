@@ -0,0 +1,73 @@
+/*
+ * Declarations for IO statistics.
+ *
+ * Copyright 2010 Mark H. Wilkinson
+ *
+ * This file is part of HDSave.
+ *
+ * HDSave is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HDSave is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HDSave.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Statistics are gathered at three levels: fs_read() calls, by what
+ * they're reading; blkio_read() calls, by where the data came from; and
+ * the reads that actually reach the device, which is where seeks happen.
+ * Collection costs nothing until stats_enable() is called. Ports that
+ * don't want the code at all can set IO_STATS to 0 in port.h.
+ */
+#ifndef IO_STATS
+#define IO_STATS 1
+#endif
+
+/*
+ * Where blkio_read() found the data.
+ */
+typedef enum {
+	STATS_FROM_MAP,
+	STATS_FROM_CLONE,
+	STATS_FROM_READAHEAD,
+	STATS_FROM_RESCUE,
+	STATS_FROM_DEVICE,
+	STATS_SOURCES
+} StatsSource;
+
+#if IO_STATS
+
+struct FSCache;
+
+extern int stats_enabled;
+
+/* Start timing an operation: pass the result to the matching stats_ call. */
+#define stats_start() (stats_enabled? clock_ns() : 0)
+
+extern void stats_enable(void);
+extern void stats_fs_read(uint64_t start, int kind, int bytes, int cache_hit, int ok);
+extern void stats_blkio_read(uint64_t start, StatsSource source, uint64_t count, int ok);
+extern void stats_device_read(uint64_t start, uint64_t offset, uint64_t count, int64_t result);
+extern void stats_print(FILE *f, int json, struct FSCache *cache);
+
+#else
+
+/*
+ * The read hooks still use the start time and source their callers keep
+ * for them, so those don't draw unused variable warnings.
+ */
+#define stats_start()					0
+#define stats_enable()					((void)0)
+#define stats_fs_read(start, kind, bytes, hit, ok)	((void)(start))
+#define stats_blkio_read(start, source, count, ok)	((void)(start), (void)(source))
+#define stats_device_read(start, offset, count, result)	((void)(start))
+#define stats_print(f, json, cache)			((void)0)
+
+#endif
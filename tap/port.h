@@ -11,3 +11,27 @@ typedef __uint64_t uint64_t;
 
 #define PRIx16		"x"
 #define PRIx32		"x"
+
+/*
+ * TAPs are single threaded, so locks are no-ops.
+ */
+typedef int mutex_t;
+
+#define mutex_init(m)		((void)0)
+#define mutex_destroy(m)	((void)0)
+#define mutex_lock(m)		((void)0)
+#define mutex_unlock(m)		((void)0)
+
+/*
+ * Memory is tight on the Toppy: don't cache metadata or pathname
+ * lookups, and keep only a few pages of the FAT in memory.
+ */
+#define FS_CACHE_SIZE 0
+#define FS_DCACHE_SIZE 0
+#define FS_FAT_INDEX 0
+#define FS_FAT_PAGED 1
+
+/*
+ * No timing or statistics on the Toppy either.
+ */
+#define IO_STATS 0
@@ -0,0 +1,675 @@
+/*
+ * Asynchronous block IO on Unix platforms.
+ *
+ * Copyright 2010 Mark H. Wilkinson
+ *
+ * This file is part of HDSave.
+ *
+ * HDSave is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HDSave is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HDSave.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "port.h"
+#include "common.h"
+#include "blkio.h"
+#include "stats.h"
+
+#include "blkio_unix.h"
+
+/*
+ * Keeping several requests in flight lets the drive (and the kernel's
+ * elevator) see the whole of a large sequential read at once, rather than
+ * one chunk at a time with a gap while we process each one.
+ *
+ * Each request goes through the same steps as blkio_read(). Those served
+ * from the mapping, the clone or readahead are finished as soon as they
+ * are submitted, and wait in the queue to be reaped. The rest go to the
+ * device. On Linux we use io_uring, talking to the kernel directly rather
+ * than depending on liburing. If io_uring isn't available (old kernel, or
+ * disabled by a sandbox), or the device is a chunked clone or in rescue
+ * mode, which need more than a plain read, we fall back to a small pool
+ * of threads, each calling blkio_read_device().
+ */
+
+#define MAX_POOL_THREADS 8
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	BlkioRequest **pending;
+	int pending_head;
+	int pending_count;
+	BlkioRequest **completed;
+	int completed_head;
+	int completed_count;
+	int stopping;
+	int num_threads;
+	pthread_t threads[MAX_POOL_THREADS];
+} BlkioPool;
+
+#ifdef __linux__
+typedef struct {
+	BlkioRequest *req;
+	struct iovec iov;
+	uint64_t done;
+	int fd;
+} BlkioSlot;
+
+typedef struct {
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+	unsigned to_submit;
+	BlkioSlot *slots;
+	int *free_slots;
+	int num_free_slots;
+} BlkioUring;
+#endif
+
+struct BlkioQueue
+{
+	DevInfo *dev;
+	int depth;
+	int inflight;
+	BlkioRequest **ready;	/* finished without going to the device */
+	BlkioRequest **to_device;	/* blkio_submit()'s batch for the backend */
+	int ready_head;
+	int ready_count;
+	int use_uring;
+	BlkioPool pool;
+#ifdef __linux__
+	BlkioUring uring;
+#endif
+};
+
+/*
+ * Thread pool implementation.
+ */
+
+static void *
+blkio_pool_worker(void *arg)
+{
+	BlkioQueue *q = (BlkioQueue *)arg;
+	BlkioPool *p = &q->pool;
+	BlkioRequest *req;
+
+	pthread_mutex_lock(&p->lock);
+	for (;;)
+	{
+		while (p->pending_count == 0 && !p->stopping)
+			pthread_cond_wait(&p->work, &p->lock);
+		if (p->pending_count == 0)
+			break;
+		req = p->pending[p->pending_head];
+		p->pending_head = (p->pending_head+1) % q->depth;
+		p->pending_count--;
+		pthread_mutex_unlock(&p->lock);
+
+		blkio_read_device(q->dev, req);
+
+		pthread_mutex_lock(&p->lock);
+		p->completed[(p->completed_head+p->completed_count) % q->depth] = req;
+		p->completed_count++;
+		pthread_cond_signal(&p->done);
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return 0;
+}
+
+static void blkio_pool_close(BlkioQueue *q);
+
+static int
+blkio_pool_open(BlkioQueue *q)
+{
+	BlkioPool *p = &q->pool;
+	int i;
+
+	memset(p, 0, sizeof(BlkioPool));
+	pthread_mutex_init(&p->lock, 0);
+	pthread_cond_init(&p->work, 0);
+	pthread_cond_init(&p->done, 0);
+
+	if ((p->pending = malloc(q->depth*sizeof(BlkioRequest *))) == 0
+		|| (p->completed = malloc(q->depth*sizeof(BlkioRequest *))) == 0)
+	{
+		no_memory("blkio_queue_open");
+		blkio_pool_close(q);
+		return 0;
+	}
+
+	for (i = 0; i < q->depth && i < MAX_POOL_THREADS; i++)
+	{
+		if (pthread_create(&p->threads[i], 0, blkio_pool_worker, q) != 0)
+		{
+			error("blkio_queue_open", "could not start IO thread");
+			blkio_pool_close(q);
+			return 0;
+		}
+		p->num_threads++;
+	}
+
+	return 1;
+}
+
+static void
+blkio_pool_close(BlkioQueue *q)
+{
+	BlkioPool *p = &q->pool;
+	int i;
+
+	pthread_mutex_lock(&p->lock);
+	p->stopping = 1;
+	pthread_cond_broadcast(&p->work);
+	pthread_mutex_unlock(&p->lock);
+
+	for (i = 0; i < p->num_threads; i++)
+		pthread_join(p->threads[i], 0);
+
+	pthread_cond_destroy(&p->done);
+	pthread_cond_destroy(&p->work);
+	pthread_mutex_destroy(&p->lock);
+	free(p->completed);
+	free(p->pending);
+}
+
+static int
+blkio_pool_submit(BlkioQueue *q, BlkioRequest **reqs, int n)
+{
+	BlkioPool *p = &q->pool;
+	int i;
+
+	pthread_mutex_lock(&p->lock);
+	for (i = 0; i < n; i++)
+		p->pending[(p->pending_head+p->pending_count++) % q->depth] = reqs[i];
+	pthread_cond_broadcast(&p->work);
+	pthread_mutex_unlock(&p->lock);
+
+	return n;
+}
+
+static int
+blkio_pool_reap(BlkioQueue *q, BlkioRequest **done, int min, int max)
+{
+	BlkioPool *p = &q->pool;
+	int n = 0;
+
+	pthread_mutex_lock(&p->lock);
+	while (p->completed_count < min)
+		pthread_cond_wait(&p->done, &p->lock);
+	while (p->completed_count > 0 && n < max)
+	{
+		done[n++] = p->completed[p->completed_head];
+		p->completed_head = (p->completed_head+1) % q->depth;
+		p->completed_count--;
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return n;
+}
+
+/*
+ * io_uring implementation.
+ */
+
+#ifdef __linux__
+
+static int
+blkio_uring_enter(BlkioUring *u, unsigned to_submit, unsigned min_complete)
+{
+	int r;
+
+	do {
+		r = syscall(__NR_io_uring_enter, u->fd, to_submit, min_complete,
+				min_complete? IORING_ENTER_GETEVENTS : 0, 0, 0);
+	} while (r == -1 && errno == EINTR);
+
+	return r;
+}
+
+static void blkio_uring_close(BlkioQueue *q);
+
+static int
+blkio_uring_open(BlkioQueue *q)
+{
+	BlkioUring *u = &q->uring;
+	struct io_uring_params params;
+	int i;
+
+	memset(u, 0, sizeof(BlkioUring));
+	memset(&params, 0, sizeof(params));
+	u->sq_ring = MAP_FAILED;
+	u->cq_ring = MAP_FAILED;
+	u->sqes = MAP_FAILED;
+
+	if ((u->fd = syscall(__NR_io_uring_setup, q->depth, &params)) == -1)
+		return 0;
+
+	u->sq_ring_size = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+	u->cq_ring_size = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (u->cq_ring_size > u->sq_ring_size)
+			u->sq_ring_size = u->cq_ring_size;
+		u->cq_ring_size = u->sq_ring_size;
+	}
+
+	u->sq_ring = mmap(0, u->sq_ring_size, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED)
+	{
+		blkio_uring_close(q);
+		return 0;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		u->cq_ring = u->sq_ring;
+	else
+		u->cq_ring = mmap(0, u->cq_ring_size, PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+	u->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+	u->sqes = mmap(0, u->sqes_size, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED)
+	{
+		blkio_uring_close(q);
+		return 0;
+	}
+
+	u->sq_head = (unsigned *)((char *)u->sq_ring + params.sq_off.head);
+	u->sq_tail = (unsigned *)((char *)u->sq_ring + params.sq_off.tail);
+	u->sq_mask = *(unsigned *)((char *)u->sq_ring + params.sq_off.ring_mask);
+	u->sq_array = (unsigned *)((char *)u->sq_ring + params.sq_off.array);
+	u->cq_head = (unsigned *)((char *)u->cq_ring + params.cq_off.head);
+	u->cq_tail = (unsigned *)((char *)u->cq_ring + params.cq_off.tail);
+	u->cq_mask = *(unsigned *)((char *)u->cq_ring + params.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + params.cq_off.cqes);
+
+	if ((u->slots = malloc(q->depth*sizeof(BlkioSlot))) == 0
+		|| (u->free_slots = malloc(q->depth*sizeof(int))) == 0)
+	{
+		blkio_uring_close(q);
+		return 0;
+	}
+	for (i = 0; i < q->depth; i++)
+		u->free_slots[i] = i;
+	u->num_free_slots = q->depth;
+
+	return 1;
+}
+
+static void
+blkio_uring_close(BlkioQueue *q)
+{
+	BlkioUring *u = &q->uring;
+
+	free(u->free_slots);
+	free(u->slots);
+	if (u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_size);
+	if (u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_size);
+	if (u->sq_ring != MAP_FAILED)
+		munmap(u->sq_ring, u->sq_ring_size);
+	if (u->fd >= 0)
+		close(u->fd);
+}
+
+/*
+ * Queue a read of whatever is left of the request in a slot. Only the
+ * submitting thread writes the SQ tail, so a plain load of our own tail
+ * is enough; the release store publishes the SQE to the kernel.
+ */
+static void
+blkio_uring_queue_slot(BlkioQueue *q, int slot_index)
+{
+	BlkioUring *u = &q->uring;
+	BlkioSlot *slot = &u->slots[slot_index];
+	BlkioRequest *req = slot->req;
+	struct io_uring_sqe *sqe;
+	unsigned tail;
+	unsigned index;
+
+	slot->iov.iov_base = (char *)req->buf + slot->done;
+	slot->iov.iov_len = req->count - slot->done;
+
+	tail = *u->sq_tail;
+	index = tail & u->sq_mask;
+	sqe = &u->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = slot->fd;
+	sqe->off = req->offset + slot->done;
+	sqe->addr = (unsigned long)&slot->iov;
+	sqe->len = 1;
+	sqe->user_data = slot_index;
+	u->sq_array[index] = index;
+	__atomic_store_n(u->sq_tail, tail+1, __ATOMIC_RELEASE);
+	u->to_submit++;
+}
+
+static int
+blkio_uring_flush(BlkioQueue *q)
+{
+	BlkioUring *u = &q->uring;
+	int r;
+
+	while (u->to_submit > 0)
+	{
+		if ((r = blkio_uring_enter(u, u->to_submit, 0)) == -1)
+		{
+			sys_error("blkio_submit", "io_uring_enter failed");
+			return 0;
+		}
+		u->to_submit -= r;
+	}
+
+	return 1;
+}
+
+static int
+blkio_uring_submit(BlkioQueue *q, BlkioRequest **reqs, int n)
+{
+	BlkioUring *u = &q->uring;
+	int slot_index;
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		slot_index = u->free_slots[--u->num_free_slots];
+		u->slots[slot_index].req = reqs[i];
+		u->slots[slot_index].done = 0;
+		u->slots[slot_index].fd = blkio_fd_for(q->dev, reqs[i]->buf, reqs[i]->offset, reqs[i]->count);
+		blkio_uring_queue_slot(q, slot_index);
+	}
+
+	if (!blkio_uring_flush(q))
+		return -1;
+
+	return n;
+}
+
+/*
+ * A short read that isn't at the end of the device is requeued for the
+ * remainder, so callers only ever see whole requests complete. The
+ * remainder may be unaligned, so it goes through the buffered descriptor.
+ */
+static int
+blkio_uring_reap(BlkioQueue *q, BlkioRequest **done, int min, int max)
+{
+	BlkioUring *u = &q->uring;
+	struct io_uring_cqe *cqe;
+	BlkioSlot *slot;
+	unsigned head;
+	unsigned tail;
+	int n = 0;
+
+	for (;;)
+	{
+		head = *u->cq_head;
+		tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		while (head != tail && n < max)
+		{
+			cqe = &u->cqes[head & u->cq_mask];
+			slot = &u->slots[cqe->user_data];
+			if (cqe->res > 0 && slot->done+cqe->res < slot->req->count)
+			{
+				slot->done += cqe->res;
+				slot->fd = q->dev->fd;
+				blkio_uring_queue_slot(q, cqe->user_data);
+			}
+			else if (cqe->res == -EINVAL && slot->fd != q->dev->fd)
+			{
+				/* Direct IO refused: retry through the page cache. */
+				slot->fd = q->dev->fd;
+				blkio_uring_queue_slot(q, cqe->user_data);
+			}
+			else
+			{
+				if (cqe->res < 0)
+					slot->req->result = cqe->res;
+				else
+					slot->req->result = slot->done+cqe->res;
+				stats_device_read(slot->req->start, slot->req->offset,
+						slot->req->count, slot->req->result);
+				done[n++] = slot->req;
+				u->free_slots[u->num_free_slots++] = cqe->user_data;
+			}
+			head++;
+		}
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+		if (!blkio_uring_flush(q))
+			return -1;
+		if (n >= min)
+			break;
+		if (blkio_uring_enter(u, 0, 1) == -1)
+		{
+			sys_error("blkio_reap", "io_uring_enter failed");
+			return -1;
+		}
+	}
+
+	return n;
+}
+
+#endif
+
+/*
+ * Generic interface.
+ */
+
+BlkioQueue *
+blkio_queue_open(DevInfo *dev, int depth)
+{
+	BlkioQueue *q;
+
+	if (depth < 1)
+	{
+		error("blkio_queue_open", "invalid queue depth %d", depth);
+		return 0;
+	}
+
+	if ((q = malloc(sizeof(BlkioQueue))) == 0)
+	{
+		no_memory("blkio_queue_open");
+		return 0;
+	}
+
+	q->dev = dev;
+	q->depth = depth;
+	q->inflight = 0;
+	q->ready_head = 0;
+	q->ready_count = 0;
+	q->use_uring = 0;
+	q->ready = malloc(depth*sizeof(BlkioRequest *));
+	q->to_device = malloc(depth*sizeof(BlkioRequest *));
+	if (!q->ready || !q->to_device)
+	{
+		no_memory("blkio_queue_open");
+		free(q->to_device);
+		free(q->ready);
+		free(q);
+		return 0;
+	}
+
+#ifdef __linux__
+	if (!dev->chunked && !blkio_rescue_enabled() && blkio_uring_open(q))
+	{
+		q->use_uring = 1;
+		return q;
+	}
+#endif
+
+	if (!blkio_pool_open(q))
+	{
+		free(q->to_device);
+		free(q->ready);
+		free(q);
+		return 0;
+	}
+
+	return q;
+}
+
+void
+blkio_queue_close(BlkioQueue *q)
+{
+	BlkioRequest *done[16];
+
+	while (q->inflight > 0)
+		if (blkio_reap(q, done, 1, elementsof(done)) < 0)
+			break;
+
+#ifdef __linux__
+	if (q->use_uring)
+		blkio_uring_close(q);
+	else
+#endif
+		blkio_pool_close(q);
+	free(q->to_device);
+	free(q->ready);
+	free(q);
+}
+
+char *
+blkio_queue_backend(BlkioQueue *q)
+{
+	return q->use_uring? "io_uring" : "threads";
+}
+
+int
+blkio_queue_space(BlkioQueue *q)
+{
+	return q->depth - q->inflight;
+}
+
+/*
+ * Returns the number of requests submitted, which may be fewer than n if
+ * the queue is full, or -1 on error.
+ */
+int
+blkio_submit(BlkioQueue *q, BlkioRequest **reqs, int n)
+{
+	int num_to_device = 0;
+	int r;
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		if (reqs[i]->offset > q->dev->bytes)
+		{
+			error("blkio_submit", "offset 0x%" PRIx64 " > disk size 0x%" PRIx64, reqs[i]->offset, q->dev->bytes);
+			return -1;
+		}
+	}
+
+	if (n > q->depth - q->inflight)
+		n = q->depth - q->inflight;
+
+	for (i = 0; i < n; i++)
+	{
+		if (blkio_read_start(q->dev, reqs[i]) == 1)
+			q->ready[(q->ready_head+q->ready_count++) % q->depth] = reqs[i];
+		else
+			q->to_device[num_to_device++] = reqs[i];
+	}
+	q->inflight += n - num_to_device;
+
+	if (num_to_device > 0)
+	{
+#ifdef __linux__
+		if (q->use_uring)
+			r = blkio_uring_submit(q, q->to_device, num_to_device);
+		else
+#endif
+			r = blkio_pool_submit(q, q->to_device, num_to_device);
+		if (r < 0)
+			return -1;
+		q->inflight += r;
+	}
+
+	return n;
+}
+
+/*
+ * Waits until at least min requests (or all of those in flight, if fewer)
+ * have completed and returns up to max of them. Each is finished here, in
+ * the reaping thread, as blkio_read() would finish it.
+ */
+int
+blkio_reap(BlkioQueue *q, BlkioRequest **done, int min, int max)
+{
+	int n = 0;
+	int r;
+	int i;
+
+	if (min > q->inflight)
+		min = q->inflight;
+	if (max > q->inflight)
+		max = q->inflight;
+	if (max == 0)
+		return 0;
+
+	while (q->ready_count > 0 && n < max)
+	{
+		done[n++] = q->ready[q->ready_head];
+		q->ready_head = (q->ready_head+1) % q->depth;
+		q->ready_count--;
+	}
+
+	if (n < max && q->inflight > n)
+	{
+#ifdef __linux__
+		if (q->use_uring)
+			r = blkio_uring_reap(q, done+n, min > n? min-n : 0, max-n);
+		else
+#endif
+			r = blkio_pool_reap(q, done+n, min > n? min-n : 0, max-n);
+		if (r < 0)
+			return -1;
+		n += r;
+	}
+
+	q->inflight -= n;
+	for (i = 0; i < n; i++)
+		if (!blkio_read_finish(q->dev, done[i]))
+			done[i]->result = -1;
+
+	return n;
+}
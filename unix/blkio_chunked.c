@@ -0,0 +1,649 @@
+/*
+ * Compressed, chunked clones of Topfield disks.
+ *
+ * Copyright 2010 Mark H. Wilkinson
+ *
+ * This file is part of HDSave.
+ *
+ * HDSave is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HDSave is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HDSave.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <zlib.h>
+
+#include "port.h"
+#include "common.h"
+#include "blkio.h"
+
+#include "blkio_unix.h"
+
+/*
+ * A sparse clone relies on the host filesystem supporting sparse files,
+ * and a clone of a whole disk is as big as the disk. A chunked clone
+ * instead divides the disk into chunks of 188 blocks, the firmware's own
+ * allocation unit, and stores each chunk that has been read compressed
+ * with zlib. The FAT, directories and the unused tails of clusters are
+ * mostly zeros or repeated bytes and shrink to almost nothing.
+ *
+ * The file starts with a header block:
+ *
+ *	0	magic		"HDSCLONE"
+ *	8	version		1
+ *	12	block size	bytes per disk block
+ *	16	chunk blocks	disk blocks per chunk
+ *	24	disk bytes	size of the disk the clone was made from
+ *	32	chunks		number of chunks covering the disk
+ *	40	index offset	where the chunk index starts
+ *
+ * followed by the chunk data, followed by the index: one 16 byte entry
+ * per chunk giving the offset of its data (8 bytes), the length of its
+ * data (4 bytes) and how it is stored (4 bytes). All numbers are little
+ * endian. Finding a chunk is a single index lookup, and the reader maps
+ * the index rather than loading it.
+ *
+ * When a clone is updated the new chunks and index are written after the
+ * old index, and the header is rewritten last, so a run that is
+ * interrupted leaves the clone as it was.
+ */
+
+#define CHUNKED_MAGIC		"HDSCLONE"
+#define CHUNKED_VERSION		1
+#define CHUNKED_HEADER_SIZE	512
+#define CHUNKED_ENTRY_SIZE	16
+#define CHUNKED_CHUNK_BLOCKS	188
+
+typedef enum {
+	CHUNK_MISSING,		/* never read; reads as zeros */
+	CHUNK_ZERO,		/* all zeros; no data stored */
+	CHUNK_RAW,		/* stored as is */
+	CHUNK_ZLIB,		/* stored compressed */
+	CHUNK_PENDING,		/* being written; writer only */
+} ChunkType;
+
+typedef struct {
+	uint64_t offset;
+	uint32_t length;
+	uint32_t type;
+} ChunkEntry;
+
+typedef struct {
+	int block_size;
+	int chunk_blocks;
+	uint64_t bytes;
+	uint64_t chunks;
+	uint64_t index_offset;
+} ChunkedHeader;
+
+static uint32_t
+get_le32(uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t
+get_le64(uint8_t *p)
+{
+	return get_le32(p) | (uint64_t)get_le32(p+4) << 32;
+}
+
+static void
+put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void
+put_le64(uint8_t *p, uint64_t v)
+{
+	put_le32(p, v);
+	put_le32(p+4, v >> 32);
+}
+
+static void
+chunked_get_entry(uint8_t *p, ChunkEntry *e)
+{
+	e->offset = get_le64(p);
+	e->length = get_le32(p+8);
+	e->type = get_le32(p+12);
+}
+
+/*
+ * Read and check the header. Returns 1 if fd is a chunked clone, 0 if
+ * it isn't, -1 if it is but the header is damaged.
+ */
+static int
+chunked_read_header(int fd, ChunkedHeader *h)
+{
+	uint8_t buf[CHUNKED_HEADER_SIZE];
+
+	if (pread(fd, buf, sizeof(buf), 0) != sizeof(buf)
+		|| memcmp(buf, CHUNKED_MAGIC, 8) != 0)
+		return 0;
+
+	if (get_le32(buf+8) != CHUNKED_VERSION)
+	{
+		error("chunked_clone", "unsupported version %u", get_le32(buf+8));
+		return -1;
+	}
+	h->block_size = get_le32(buf+12);
+	h->chunk_blocks = get_le32(buf+16);
+	h->bytes = get_le64(buf+24);
+	h->chunks = get_le64(buf+32);
+	h->index_offset = get_le64(buf+40);
+	if (h->block_size <= 0 || h->chunk_blocks <= 0
+		|| h->chunks != (h->bytes + (uint64_t)h->block_size*h->chunk_blocks - 1)
+				/ ((uint64_t)h->block_size*h->chunk_blocks))
+	{
+		error("chunked_clone", "bad header");
+		return -1;
+	}
+	return 1;
+}
+
+static int
+chunked_write_header(int fd, ChunkedHeader *h)
+{
+	uint8_t buf[CHUNKED_HEADER_SIZE];
+
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, CHUNKED_MAGIC, 8);
+	put_le32(buf+8, CHUNKED_VERSION);
+	put_le32(buf+12, h->block_size);
+	put_le32(buf+16, h->chunk_blocks);
+	put_le64(buf+24, h->bytes);
+	put_le64(buf+32, h->chunks);
+	put_le64(buf+40, h->index_offset);
+
+	return pwrite(fd, buf, sizeof(buf), 0) == sizeof(buf)? 0 : -1;
+}
+
+/*
+ * Reading a chunked clone. blkio_open() recognises one by its header and
+ * from then on blkio_pread() comes here instead of reading the file.
+ */
+
+struct BlkioChunked {
+	ChunkedHeader h;
+	uint64_t chunk_bytes;
+	uint64_t file_size;	/* of the clone, when it was opened */
+	uint8_t *index_map;
+	size_t index_map_size;
+	uint8_t *index;
+	pthread_mutex_t lock;
+	uint64_t last_chunk;	/* one chunk cache for partial reads */
+	char *last_data;
+};
+
+int
+blkio_chunked_probe(DevInfo *dev)
+{
+	BlkioChunked *c;
+	ChunkedHeader h;
+	struct stat st;
+	long page = sysconf(_SC_PAGESIZE);
+	uint64_t start;
+	int r;
+
+	dev->chunked = 0;
+	if ((r = chunked_read_header(dev->fd, &h)) <= 0)
+		return r;
+
+	/*
+	 * A clone cut short, by a full disk say, would otherwise only show
+	 * up as a SIGBUS when the index is first touched.
+	 */
+	if (fstat(dev->fd, &st) == -1)
+	{
+		sys_error("blkio_chunked_probe", "couldn't stat '%s'", dev->path);
+		return -1;
+	}
+	if (h.index_offset < CHUNKED_HEADER_SIZE || h.index_offset > st.st_size
+		|| h.chunks > (st.st_size - h.index_offset)/CHUNKED_ENTRY_SIZE)
+	{
+		error("chunked_clone", "chunk index of '%s' runs past the end of the file", dev->path);
+		return -1;
+	}
+
+	if ((c = malloc(sizeof(BlkioChunked))) == 0)
+	{
+		no_memory("blkio_chunked_probe");
+		return -1;
+	}
+	c->h = h;
+	c->chunk_bytes = (uint64_t)h.block_size*h.chunk_blocks;
+	c->file_size = st.st_size;
+	start = h.index_offset & ~(page-1);
+	c->index_map_size = h.index_offset - start + h.chunks*CHUNKED_ENTRY_SIZE;
+	c->index_map = mmap(0, c->index_map_size, PROT_READ, MAP_SHARED, dev->fd, start);
+	if (c->index_map == MAP_FAILED)
+	{
+		sys_error("blkio_chunked_probe", "couldn't map chunk index of '%s'", dev->path);
+		free(c);
+		return -1;
+	}
+	c->index = c->index_map + (h.index_offset - start);
+	pthread_mutex_init(&c->lock, 0);
+	c->last_chunk = h.chunks;
+	c->last_data = 0;
+
+	dev->chunked = c;
+	dev->block_size = h.block_size;
+	dev->bytes = h.bytes;
+	dev->blocks = h.bytes/h.block_size;
+
+	return 1;
+}
+
+void
+blkio_chunked_close(DevInfo *dev)
+{
+	BlkioChunked *c = dev->chunked;
+
+	if (!c)
+		return;
+	munmap(c->index_map, c->index_map_size);
+	pthread_mutex_destroy(&c->lock);
+	free(c->last_data);
+	free(c);
+	dev->chunked = 0;
+}
+
+/*
+ * Unpack chunk n, which is size bytes long, into buf. The index comes
+ * from the file, so its entries are checked against the file before any
+ * reading or allocating is done on their say-so.
+ */
+static int64_t
+chunked_unpack(DevInfo *dev, uint64_t n, char *buf, uint64_t size)
+{
+	BlkioChunked *c = dev->chunked;
+	ChunkEntry e;
+	uLongf out = size;
+	char *data;
+	int64_t result = size;
+
+	chunked_get_entry(c->index + n*CHUNKED_ENTRY_SIZE, &e);
+	if ((e.type == CHUNK_RAW || e.type == CHUNK_ZLIB)
+		&& (e.offset > c->file_size || e.length > c->file_size - e.offset))
+		return -EIO;
+	switch (e.type)
+	{
+	case CHUNK_MISSING:
+	case CHUNK_ZERO:
+		memset(buf, 0, size);
+		return size;
+	case CHUNK_RAW:
+		if (e.length != size)
+			return -EIO;
+		return pread(dev->fd, buf, size, e.offset) == size? size : -EIO;
+	case CHUNK_ZLIB:
+		if (e.length > compressBound(c->chunk_bytes))
+			return -EIO;
+		if ((data = malloc(e.length)) == 0)
+			return -ENOMEM;
+		if (pread(dev->fd, data, e.length, e.offset) != e.length
+			|| uncompress((Bytef *)buf, &out, (Bytef *)data, e.length) != Z_OK
+			|| out != size)
+			result = -EIO;
+		free(data);
+		return result;
+	default:
+		return -EIO;
+	}
+}
+
+int64_t
+blkio_chunked_read(DevInfo *dev, void *buf, uint64_t offset, uint64_t count)
+{
+	BlkioChunked *c = dev->chunked;
+	uint64_t n;
+	uint64_t start;
+	uint64_t size;
+	uint64_t skip;
+	uint64_t len;
+	uint64_t done = 0;
+	int64_t r;
+	char *data;
+
+	if (offset >= c->h.bytes)
+		return 0;
+	if (count > c->h.bytes-offset)
+		count = c->h.bytes-offset;
+
+	while (done < count)
+	{
+		n = (offset+done)/c->chunk_bytes;
+		start = n*c->chunk_bytes;
+		size = c->h.bytes-start < c->chunk_bytes? c->h.bytes-start : c->chunk_bytes;
+		skip = offset+done-start;
+		len = size-skip < count-done? size-skip : count-done;
+
+		if (skip == 0 && len == size)
+		{
+			if ((r = chunked_unpack(dev, n, (char *)buf+done, size)) < 0)
+				return r;
+			done += len;
+			continue;
+		}
+
+		pthread_mutex_lock(&c->lock);
+		if (c->last_chunk == n)
+		{
+			memcpy((char *)buf+done, c->last_data+skip, len);
+			pthread_mutex_unlock(&c->lock);
+			done += len;
+			continue;
+		}
+		pthread_mutex_unlock(&c->lock);
+
+		if ((data = malloc(size)) == 0)
+			return -ENOMEM;
+		if ((r = chunked_unpack(dev, n, data, size)) < 0)
+		{
+			free(data);
+			return r;
+		}
+		memcpy((char *)buf+done, data+skip, len);
+		done += len;
+
+		pthread_mutex_lock(&c->lock);
+		free(c->last_data);
+		c->last_data = data;
+		c->last_chunk = n;
+		pthread_mutex_unlock(&c->lock);
+	}
+
+	return done;
+}
+
+/*
+ * Writing a chunked clone. This is an each block hook, like the sparse
+ * clone writer: whenever a read touches a chunk that isn't in the clone
+ * yet, the whole chunk is read from the disk, compressed and appended.
+ * The index is kept in memory and written out when the clone is closed.
+ * The hook may be called from several threads; the lock covers the index
+ * and the end of the file, and compression happens outside it.
+ */
+
+static char *chunked_clone_path;
+static int chunked_clone_fd = -1;
+static int chunked_clone_failed;
+static mutex_t chunked_clone_lock;
+static ChunkedHeader chunked_clone_h;
+static uint64_t chunked_clone_chunk_bytes;
+static ChunkEntry *chunked_clone_index;
+static uint64_t chunked_clone_end;
+
+/*
+ * Set up the index for dev, loading it from an existing clone if there
+ * is one. Returns 0 if we can't write a clone.
+ */
+static int
+chunked_clone_start(DevInfo *dev)
+{
+	ChunkedHeader old;
+	ChunkedHeader *h = &chunked_clone_h;
+	uint8_t *buf;
+	uint64_t i;
+	int r;
+
+	mutex_lock(&chunked_clone_lock);
+	if (chunked_clone_index || chunked_clone_failed)
+	{
+		mutex_unlock(&chunked_clone_lock);
+		return chunked_clone_index != 0;
+	}
+	chunked_clone_failed = 1;
+
+	h->block_size = dev->block_size;
+	h->chunk_blocks = CHUNKED_CHUNK_BLOCKS;
+	h->bytes = dev->bytes;
+	chunked_clone_chunk_bytes = (uint64_t)h->block_size*h->chunk_blocks;
+	h->chunks = (h->bytes + chunked_clone_chunk_bytes - 1)/chunked_clone_chunk_bytes;
+	h->index_offset = 0;
+
+	if ((chunked_clone_index = calloc(h->chunks, sizeof(ChunkEntry))) == 0)
+	{
+		no_memory("chunked_clone");
+		mutex_unlock(&chunked_clone_lock);
+		return 0;
+	}
+	chunked_clone_end = CHUNKED_HEADER_SIZE;
+
+	if ((r = chunked_read_header(chunked_clone_fd, &old)) < 0)
+		goto fail;
+	if (r > 0)
+	{
+		if (old.block_size != h->block_size || old.chunk_blocks != h->chunk_blocks
+			|| old.bytes != h->bytes)
+		{
+			error("chunked_clone", "'%s' is a clone of a different disk", chunked_clone_path);
+			goto fail;
+		}
+		if ((buf = malloc(h->chunks*CHUNKED_ENTRY_SIZE)) == 0)
+		{
+			no_memory("chunked_clone");
+			goto fail;
+		}
+		if (pread(chunked_clone_fd, buf, h->chunks*CHUNKED_ENTRY_SIZE, old.index_offset)
+				!= h->chunks*CHUNKED_ENTRY_SIZE)
+		{
+			error("chunked_clone", "couldn't read chunk index of '%s'", chunked_clone_path);
+			free(buf);
+			goto fail;
+		}
+		for (i = 0; i < h->chunks; i++)
+			chunked_get_entry(buf + i*CHUNKED_ENTRY_SIZE, &chunked_clone_index[i]);
+		free(buf);
+		h->index_offset = old.index_offset;
+		chunked_clone_end = old.index_offset + h->chunks*CHUNKED_ENTRY_SIZE;
+	}
+
+	chunked_clone_failed = 0;
+	mutex_unlock(&chunked_clone_lock);
+	return 1;
+
+fail:
+	free(chunked_clone_index);
+	chunked_clone_index = 0;
+	mutex_unlock(&chunked_clone_lock);
+	return 0;
+}
+
+static int
+chunk_is_zero(char *data, uint64_t size)
+{
+	return data[0] == 0 && memcmp(data, data+1, size-1) == 0;
+}
+
+/*
+ * Compress and append one chunk, already claimed by the caller.
+ */
+static void
+chunked_clone_store(uint64_t n, char *data, uint64_t size)
+{
+	ChunkEntry e;
+	uLongf clen = compressBound(size);
+	char *cdata = 0;
+	char *out = data;
+
+	e.length = 0;
+	e.offset = 0;
+	if (chunk_is_zero(data, size))
+	{
+		e.type = CHUNK_ZERO;
+	}
+	else
+	{
+		e.type = CHUNK_RAW;
+		e.length = size;
+		if ((cdata = malloc(clen)) != 0
+			&& compress((Bytef *)cdata, &clen, (Bytef *)data, size) == Z_OK
+			&& clen < size)
+		{
+			e.type = CHUNK_ZLIB;
+			e.length = clen;
+			out = cdata;
+		}
+	}
+
+	if (e.length > 0)
+	{
+		mutex_lock(&chunked_clone_lock);
+		e.offset = chunked_clone_end;
+		chunked_clone_end += e.length;
+		mutex_unlock(&chunked_clone_lock);
+
+		if (pwrite(chunked_clone_fd, out, e.length, e.offset) != e.length)
+		{
+			sys_error("blkio_write_chunked_clone", "write failed");
+			e.type = CHUNK_MISSING;
+		}
+	}
+	free(cdata);
+
+	mutex_lock(&chunked_clone_lock);
+	chunked_clone_index[n] = e;
+	mutex_unlock(&chunked_clone_lock);
+}
+
+void
+blkio_write_chunked_clone(DevInfo *dev, void *buf, uint64_t offset, uint64_t count)
+{
+	uint64_t cb;
+	uint64_t n;
+	uint64_t start;
+	uint64_t size;
+	char *data;
+	int64_t r;
+
+	if (!chunked_clone_start(dev) || count == 0 || offset >= dev->bytes)
+		return;
+
+	cb = chunked_clone_chunk_bytes;
+	for (n = offset/cb; n*cb < offset+count && n < chunked_clone_h.chunks; n++)
+	{
+		mutex_lock(&chunked_clone_lock);
+		if (chunked_clone_index[n].type != CHUNK_MISSING)
+		{
+			mutex_unlock(&chunked_clone_lock);
+			continue;
+		}
+		chunked_clone_index[n].type = CHUNK_PENDING;
+		mutex_unlock(&chunked_clone_lock);
+
+		start = n*cb;
+		size = dev->bytes-start < cb? dev->bytes-start : cb;
+		if (start >= offset && start+size <= offset+count)
+		{
+			chunked_clone_store(n, (char *)buf + (start-offset), size);
+			continue;
+		}
+
+		/* The read only covered part of the chunk: fetch the rest. */
+		if ((data = malloc(size)) == 0)
+			r = -ENOMEM;
+		else if (blkio_rescue_enabled())
+			r = blkio_rescue_read(dev, data, start, size);
+		else
+			r = blkio_pread(dev, data, start, size);
+		if (r == size)
+		{
+			chunked_clone_store(n, data, size);
+		}
+		else
+		{
+			mutex_lock(&chunked_clone_lock);
+			chunked_clone_index[n].type = CHUNK_MISSING;
+			mutex_unlock(&chunked_clone_lock);
+		}
+		free(data);
+	}
+}
+
+void
+blkio_open_chunked_clone(char *path)
+{
+	if ((chunked_clone_fd = open(path, O_RDWR|O_CREAT, 0666)) == -1)
+	{
+		sys_error("chunked_clone", "couldn't open %s", path);
+		return;
+	}
+	chunked_clone_path = path;
+	mutex_init(&chunked_clone_lock);
+	blkio_each_block_fn(blkio_write_chunked_clone);
+}
+
+void
+blkio_close_chunked_clone(void)
+{
+	ChunkedHeader *h = &chunked_clone_h;
+	uint8_t *buf;
+	uint64_t stored = 0;
+	uint64_t i;
+
+	blkio_each_block_fn(0);
+	if (chunked_clone_fd < 0)
+		return;
+
+	if (chunked_clone_index)
+	{
+		if ((buf = malloc(h->chunks*CHUNKED_ENTRY_SIZE)) == 0)
+		{
+			no_memory("chunked_clone");
+		}
+		else
+		{
+			for (i = 0; i < h->chunks; i++)
+			{
+				ChunkEntry *e = &chunked_clone_index[i];
+
+				put_le64(buf + i*CHUNKED_ENTRY_SIZE, e->offset);
+				put_le32(buf + i*CHUNKED_ENTRY_SIZE + 8, e->length);
+				put_le32(buf + i*CHUNKED_ENTRY_SIZE + 12, e->type);
+				if (e->type != CHUNK_MISSING)
+					stored++;
+			}
+			h->index_offset = chunked_clone_end;
+			if (pwrite(chunked_clone_fd, buf, h->chunks*CHUNKED_ENTRY_SIZE, h->index_offset)
+					!= h->chunks*CHUNKED_ENTRY_SIZE
+				|| fsync(chunked_clone_fd) == -1
+				|| chunked_write_header(chunked_clone_fd, h) == -1
+				|| fsync(chunked_clone_fd) == -1)
+				sys_error("chunked_clone", "couldn't write chunk index to %s", chunked_clone_path);
+			else
+				fprintf(stderr, "%" PRIu64 " of %" PRIu64 " chunks in '%s'\n",
+						stored, h->chunks, chunked_clone_path);
+			free(buf);
+		}
+		free(chunked_clone_index);
+		chunked_clone_index = 0;
+	}
+
+	mutex_destroy(&chunked_clone_lock);
+	close(chunked_clone_fd);
+	chunked_clone_fd = -1;
+	chunked_clone_failed = 0;
+	chunked_clone_path = 0;
+}
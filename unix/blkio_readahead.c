@@ -0,0 +1,316 @@
+/*
+ * Background readahead for block IO on Unix platforms.
+ *
+ * Copyright 2010 Mark H. Wilkinson
+ *
+ * This file is part of HDSave.
+ *
+ * HDSave is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HDSave is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HDSave.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "port.h"
+#include "common.h"
+#include "blkio.h"
+
+#include "blkio_unix.h"
+
+/*
+ * The file layer calls blkio_prefetch() for the next few chunks of a file
+ * it sees being read sequentially. Each prefetched range gets a slot,
+ * which a per-device thread fills in the background. When blkio_read()
+ * asks for data that lies within a slot it takes it from there, waiting
+ * for the thread to finish if it has already started on that slot. The
+ * disk is then busy with the next chunk while the caller is writing out
+ * the last one.
+ *
+ * If all the slots are in use the hint is passed on to the kernel with
+ * posix_fadvise() instead. Mapped images don't need the thread at all:
+ * madvise() does the same job. Nor do ranges a sparse clone already holds,
+ * as blkio_read() will take them from the clone. There's no readahead at
+ * all in rescue mode, which must be left to read a failing disk its own
+ * careful way.
+ */
+
+#define READAHEAD_SLOTS 8
+
+typedef enum {
+	SLOT_FREE,
+	SLOT_QUEUED,
+	SLOT_READING,
+	SLOT_READY,
+} SlotState;
+
+typedef struct {
+	SlotState state;
+	uint64_t offset;
+	uint64_t count;
+	int64_t result;
+	unsigned seq;
+	char *buf;
+	int buf_size;
+} ReadaheadSlot;
+
+struct BlkioReadahead {
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t ready;
+	pthread_t thread;
+	int stopping;
+	unsigned seq;
+	ReadaheadSlot slots[READAHEAD_SLOTS];
+};
+
+static ReadaheadSlot *
+blkio_readahead_next_queued(BlkioReadahead *ra)
+{
+	ReadaheadSlot *oldest = 0;
+	int i;
+
+	for (i = 0; i < READAHEAD_SLOTS; i++)
+		if (ra->slots[i].state == SLOT_QUEUED
+			&& (!oldest || (int)(ra->slots[i].seq - oldest->seq) < 0))
+			oldest = &ra->slots[i];
+	return oldest;
+}
+
+static void *
+blkio_readahead_thread(void *arg)
+{
+	DevInfo *dev = (DevInfo *)arg;
+	BlkioReadahead *ra = dev->ra;
+	ReadaheadSlot *slot;
+	int64_t result;
+
+	pthread_mutex_lock(&ra->lock);
+	for (;;)
+	{
+		while (!ra->stopping && (slot = blkio_readahead_next_queued(ra)) == 0)
+			pthread_cond_wait(&ra->queued, &ra->lock);
+		if (ra->stopping)
+			break;
+		slot->state = SLOT_READING;
+		pthread_mutex_unlock(&ra->lock);
+
+		result = blkio_pread(dev, slot->buf, slot->offset, slot->count);
+
+		pthread_mutex_lock(&ra->lock);
+		slot->result = result;
+		slot->state = SLOT_READY;
+		pthread_cond_broadcast(&ra->ready);
+	}
+	pthread_mutex_unlock(&ra->lock);
+
+	return 0;
+}
+
+static BlkioReadahead *
+blkio_readahead_start(DevInfo *dev)
+{
+	BlkioReadahead *ra;
+
+	pthread_mutex_lock(&dev->pool_lock);
+	if ((ra = dev->ra) == 0)
+	{
+		if ((ra = malloc(sizeof(BlkioReadahead))) != 0)
+		{
+			memset(ra, 0, sizeof(BlkioReadahead));
+			pthread_mutex_init(&ra->lock, 0);
+			pthread_cond_init(&ra->queued, 0);
+			pthread_cond_init(&ra->ready, 0);
+			dev->ra = ra;
+			if (pthread_create(&ra->thread, 0, blkio_readahead_thread, dev) != 0)
+			{
+				dev->ra = 0;
+				free(ra);
+				ra = 0;
+			}
+		}
+	}
+	pthread_mutex_unlock(&dev->pool_lock);
+
+	return ra;
+}
+
+/*
+ * Find a slot for a new prefetch: a free one, or failing that the oldest
+ * one that has been read but never asked for.
+ */
+static ReadaheadSlot *
+blkio_readahead_free_slot(BlkioReadahead *ra)
+{
+	ReadaheadSlot *oldest = 0;
+	int i;
+
+	for (i = 0; i < READAHEAD_SLOTS; i++)
+	{
+		if (ra->slots[i].state == SLOT_FREE)
+			return &ra->slots[i];
+		if (ra->slots[i].state == SLOT_READY
+			&& (!oldest || (int)(ra->slots[i].seq - oldest->seq) < 0))
+			oldest = &ra->slots[i];
+	}
+	return oldest;
+}
+
+void
+blkio_prefetch(DevInfo *dev, uint64_t offset, uint64_t count)
+{
+	BlkioReadahead *ra;
+	ReadaheadSlot *slot;
+	int i;
+
+	if (offset > dev->bytes || count > dev->bytes-offset)
+		return;
+
+	/*
+	 * Rescue mode reads around bad blocks a piece at a time, and
+	 * skips the ones already listed. A big read ahead would hit them
+	 * all again.
+	 */
+	if (blkio_rescue_enabled())
+		return;
+
+	if (dev->map && offset+count <= dev->map_size)
+	{
+		long page = sysconf(_SC_PAGESIZE);
+		uint64_t start = offset & ~(page-1);
+
+		madvise((char *)dev->map+start, offset+count-start, MADV_WILLNEED);
+		return;
+	}
+
+	if (blkio_sparse_valid(dev, offset, count))
+		return;
+
+	if ((ra = dev->ra) == 0 && (ra = blkio_readahead_start(dev)) == 0)
+		return;
+
+	pthread_mutex_lock(&ra->lock);
+	for (i = 0; i < READAHEAD_SLOTS; i++)
+	{
+		slot = &ra->slots[i];
+		if (slot->state != SLOT_FREE
+			&& offset >= slot->offset
+			&& offset+count <= slot->offset+slot->count)
+		{
+			pthread_mutex_unlock(&ra->lock);
+			return;
+		}
+	}
+
+	if ((slot = blkio_readahead_free_slot(ra)) == 0)
+	{
+		pthread_mutex_unlock(&ra->lock);
+		if (dev->direct_fd < 0 && !dev->chunked)
+			posix_fadvise(dev->fd, offset, count, POSIX_FADV_WILLNEED);
+		return;
+	}
+
+	if (slot->buf_size < count)
+	{
+		blkio_buffer_free(dev, slot->buf, slot->buf_size);
+		slot->buf_size = 0;
+		if ((slot->buf = blkio_buffer_alloc(dev, count)) == 0)
+		{
+			slot->state = SLOT_FREE;
+			pthread_mutex_unlock(&ra->lock);
+			return;
+		}
+		slot->buf_size = count;
+	}
+
+	slot->offset = offset;
+	slot->count = count;
+	slot->seq = ra->seq++;
+	slot->state = SLOT_QUEUED;
+	pthread_cond_signal(&ra->queued);
+	pthread_mutex_unlock(&ra->lock);
+}
+
+/*
+ * Satisfy a read from a readahead slot if one covers it. Returns 1 if buf
+ * has been filled, 0 if the caller should read from the device itself.
+ * A slot the thread hasn't started on yet is cancelled rather than waited
+ * for, as the caller can read it just as quickly itself.
+ */
+int
+blkio_readahead_take(DevInfo *dev, void *buf, uint64_t offset, uint64_t count)
+{
+	BlkioReadahead *ra = dev->ra;
+	ReadaheadSlot *slot;
+	int taken = 0;
+	int i;
+
+	if (!ra)
+		return 0;
+
+	pthread_mutex_lock(&ra->lock);
+	for (i = 0; i < READAHEAD_SLOTS; i++)
+	{
+		slot = &ra->slots[i];
+		if (slot->state == SLOT_FREE
+			|| offset < slot->offset
+			|| offset+count > slot->offset+slot->count)
+			continue;
+
+		if (slot->state == SLOT_QUEUED)
+		{
+			slot->state = SLOT_FREE;
+			break;
+		}
+		while (slot->state == SLOT_READING)
+			pthread_cond_wait(&ra->ready, &ra->lock);
+		if (slot->state == SLOT_READY && slot->result == slot->count)
+		{
+			memcpy(buf, slot->buf+(offset-slot->offset), count);
+			taken = 1;
+		}
+		slot->state = SLOT_FREE;
+		break;
+	}
+	pthread_mutex_unlock(&ra->lock);
+
+	return taken;
+}
+
+void
+blkio_readahead_close(DevInfo *dev)
+{
+	BlkioReadahead *ra = dev->ra;
+	int i;
+
+	if (!ra)
+		return;
+
+	pthread_mutex_lock(&ra->lock);
+	ra->stopping = 1;
+	pthread_cond_broadcast(&ra->queued);
+	pthread_mutex_unlock(&ra->lock);
+	pthread_join(ra->thread, 0);
+
+	for (i = 0; i < READAHEAD_SLOTS; i++)
+		blkio_buffer_free(dev, ra->slots[i].buf, ra->slots[i].buf_size);
+	pthread_cond_destroy(&ra->ready);
+	pthread_cond_destroy(&ra->queued);
+	pthread_mutex_destroy(&ra->lock);
+	free(ra);
+	dev->ra = 0;
+}
@@ -0,0 +1,325 @@
+/*
+ * Keep reading past unreadable blocks on a failing disk.
+ *
+ * Copyright 2010 Mark H. Wilkinson
+ *
+ * This file is part of HDSave.
+ *
+ * HDSave is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HDSave is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HDSave.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "port.h"
+#include "common.h"
+#include "blkio.h"
+
+#include "blkio_unix.h"
+
+/*
+ * In rescue mode reads are still issued in large pieces, as that's the
+ * fast way to read a healthy disk. If one fails we split it in half and
+ * try each half, down to single blocks. Blocks that still can't be read
+ * are filled with zeros and added to the bad block list, so the rest of
+ * the read succeeds and the command carries on.
+ *
+ * The bad block list is loaded from, and saved back to, a file with one
+ * block number per line: the same format as badblocks(8) output. A later
+ * run skips the listed blocks without touching the disk (a marginal
+ * sector can take seconds to fail each time) unless asked to retry them,
+ * in which case blocks that can now be read are removed from the list.
+ */
+
+static char *rescue_path;
+static int rescue_retry;
+static mutex_t rescue_lock;
+static uint64_t *bad_blocks;
+static int num_bad_blocks;
+static int max_bad_blocks;
+
+/*
+ * Index of the first listed block >= block. Call with the lock held.
+ */
+static int
+blkio_rescue_search(uint64_t block)
+{
+	int lo = 0;
+	int hi = num_bad_blocks;
+	int mid;
+
+	while (lo < hi)
+	{
+		mid = (lo+hi)/2;
+		if (bad_blocks[mid] < block)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void
+blkio_rescue_add(uint64_t block)
+{
+	uint64_t *new_blocks;
+	int i;
+
+	mutex_lock(&rescue_lock);
+	i = blkio_rescue_search(block);
+	if (i < num_bad_blocks && bad_blocks[i] == block)
+	{
+		mutex_unlock(&rescue_lock);
+		return;
+	}
+	if (num_bad_blocks == max_bad_blocks)
+	{
+		int new_max = max_bad_blocks? 2*max_bad_blocks : 64;
+
+		if ((new_blocks = realloc(bad_blocks, new_max*sizeof(uint64_t))) == 0)
+		{
+			mutex_unlock(&rescue_lock);
+			return;
+		}
+		bad_blocks = new_blocks;
+		max_bad_blocks = new_max;
+	}
+	memmove(&bad_blocks[i+1], &bad_blocks[i], (num_bad_blocks-i)*sizeof(uint64_t));
+	bad_blocks[i] = block;
+	num_bad_blocks++;
+	mutex_unlock(&rescue_lock);
+}
+
+static void
+blkio_rescue_remove(uint64_t block)
+{
+	int i;
+
+	mutex_lock(&rescue_lock);
+	i = blkio_rescue_search(block);
+	if (i < num_bad_blocks && bad_blocks[i] == block)
+	{
+		memmove(&bad_blocks[i], &bad_blocks[i+1], (num_bad_blocks-i-1)*sizeof(uint64_t));
+		num_bad_blocks--;
+	}
+	mutex_unlock(&rescue_lock);
+}
+
+static uint64_t
+blkio_rescue_count(uint64_t first, uint64_t last)
+{
+	int n;
+
+	mutex_lock(&rescue_lock);
+	n = blkio_rescue_search(last) - blkio_rescue_search(first);
+	mutex_unlock(&rescue_lock);
+
+	return n;
+}
+
+/*
+ * First listed block in [first, last), or last if there are none.
+ */
+static uint64_t
+blkio_rescue_next_bad(uint64_t first, uint64_t last)
+{
+	uint64_t block = last;
+	int i;
+
+	mutex_lock(&rescue_lock);
+	i = blkio_rescue_search(first);
+	if (i < num_bad_blocks && bad_blocks[i] < last)
+		block = bad_blocks[i];
+	mutex_unlock(&rescue_lock);
+
+	return block;
+}
+
+void
+blkio_open_rescue(char *path, int retry)
+{
+	FILE *f;
+	unsigned long long block;
+
+	mutex_init(&rescue_lock);
+	rescue_path = path;
+	rescue_retry = retry;
+
+	if ((f = fopen(path, "r")) == 0)
+		return;
+	while (fscanf(f, "%llu", &block) == 1)
+		blkio_rescue_add(block);
+	fclose(f);
+
+	if (num_bad_blocks > 0)
+		fprintf(stderr, "%d bad blocks listed in '%s'%s\n", num_bad_blocks, path,
+				rescue_retry? ", will retry them" : "");
+}
+
+void
+blkio_close_rescue(void)
+{
+	FILE *f;
+	int i;
+
+	if (!rescue_path)
+		return;
+
+	if ((f = fopen(rescue_path, "w")) == 0)
+	{
+		fprintf(stderr, "warning: could not save bad block list to '%s'\n", rescue_path);
+	}
+	else
+	{
+		for (i = 0; i < num_bad_blocks; i++)
+			fprintf(f, "%llu\n", (unsigned long long)bad_blocks[i]);
+		fclose(f);
+		if (num_bad_blocks > 0)
+			fprintf(stderr, "%d bad blocks listed in '%s'\n", num_bad_blocks, rescue_path);
+	}
+
+	free(bad_blocks);
+	bad_blocks = 0;
+	num_bad_blocks = max_bad_blocks = 0;
+	mutex_destroy(&rescue_lock);
+	rescue_path = 0;
+}
+
+int
+blkio_rescue_enabled(void)
+{
+	return rescue_path != 0;
+}
+
+/*
+ * Forget listed blocks in [block, end), which have just been read.
+ */
+static void
+blkio_rescue_clear(uint64_t block, uint64_t end)
+{
+	uint64_t bad;
+
+	while ((bad = blkio_rescue_next_bad(block, end)) < end)
+	{
+		blkio_rescue_remove(bad);
+		block = bad+1;
+	}
+}
+
+/*
+ * Read a range of whole blocks, bisecting on failure.
+ */
+static void
+blkio_rescue_bisect(DevInfo *dev, char *buf, uint64_t block, uint64_t blocks)
+{
+	int bs = dev->block_size;
+	uint64_t half;
+
+	if (blkio_pread(dev, buf, block*bs, blocks*bs) == blocks*bs)
+	{
+		if (rescue_retry)
+			blkio_rescue_clear(block, block+blocks);
+		return;
+	}
+
+	if (blocks == 1)
+	{
+		memset(buf, 0, bs);
+		blkio_rescue_add(block);
+		return;
+	}
+
+	half = blocks/2;
+	blkio_rescue_bisect(dev, buf, block, half);
+	blkio_rescue_bisect(dev, buf+half*bs, block+half, blocks-half);
+}
+
+/*
+ * Read whole blocks, going around any already known to be bad unless
+ * we've been asked to retry them.
+ */
+static void
+blkio_rescue_blocks(DevInfo *dev, char *buf, uint64_t block, uint64_t blocks)
+{
+	int bs = dev->block_size;
+	uint64_t end = block+blocks;
+	uint64_t bad;
+
+	if (rescue_retry)
+	{
+		blkio_rescue_bisect(dev, buf, block, blocks);
+		return;
+	}
+
+	while (block < end)
+	{
+		bad = blkio_rescue_next_bad(block, end);
+		if (bad > block)
+		{
+			if (blkio_pread(dev, buf, block*bs, (bad-block)*bs) != (bad-block)*bs)
+				blkio_rescue_bisect(dev, buf, block, bad-block);
+			buf += (bad-block)*bs;
+			block = bad;
+		}
+		if (block < end)
+		{
+			memset(buf, 0, bs);
+			buf += bs;
+			block++;
+		}
+	}
+}
+
+/*
+ * Read a range that lies within the device. Never fails: anything that
+ * can't be read comes back as zeros. Reads that don't start or end on a
+ * block boundary go through a bounce buffer.
+ */
+int64_t
+blkio_rescue_read(DevInfo *dev, void *buf, uint64_t offset, uint64_t count)
+{
+	int bs = dev->block_size;
+	uint64_t first = offset/bs;
+	uint64_t last = (offset+count+bs-1)/bs;
+	char *bounce;
+
+	if (offset % bs == 0 && count % bs == 0)
+	{
+		blkio_rescue_blocks(dev, buf, first, last-first);
+		return count;
+	}
+
+	if ((bounce = malloc((last-first)*bs)) == 0)
+	{
+		no_memory("blkio_rescue_read");
+		return -ENOMEM;
+	}
+	blkio_rescue_blocks(dev, bounce, first, last-first);
+	memcpy(buf, bounce+(offset-first*bs), count);
+	free(bounce);
+
+	return count;
+}
+
+uint64_t
+blkio_bad_blocks(DevInfo *dev, uint64_t offset, uint64_t count)
+{
+	int bs = dev->block_size;
+
+	if (!rescue_path || count == 0)
+		return 0;
+	return blkio_rescue_count(offset/bs, (offset+count+bs-1)/bs);
+}
@@ -1,5 +1,5 @@
 /*
- * Write accessed disk blocks to a sparse clone file.
+ * Write accessed disk blocks to a sparse clone file, and read them back.
  *
  * Copyright 2010 Mark H. Wilkinson
  *
@@ -20,8 +20,11 @@
  */
 
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <linux/fs.h>
 
@@ -41,49 +44,249 @@
  * of any block accessed by the tfhd program while it runs. Typically
  * this is used in conjunction with the 'map' command that visits every
  * directory on the disk.
+ *
+ * Alongside the clone we keep a bitmap, one bit per disk block, in a file
+ * with the same name plus '.valid'. A set bit means the clone holds a
+ * copy of that block. This lets the clone act as a cache that survives
+ * between runs: reads of blocks already in the clone are served from it
+ * without touching the disk, and blocks already copied aren't written
+ * again. A second 'map' of a slow or flaky disk then reads almost nothing
+ * from the disk itself. Only whole blocks are marked, and blocks that
+ * rescue mode had to fill with zeros are never marked, so they will be
+ * tried again next time.
+ *
+ * The bitmap can only be sized once we know how big the disk is, so it
+ * is attached on first use. It is mapped shared, and bits are set
+ * atomically, so the hook may be called from several reading threads at
+ * once. Blocks are written with pwrite() for the same reason.
  */
 
 static int sparse_clone_fd = -1;
+static char *sparse_valid_path;
+static int sparse_valid_failed;
+static mutex_t sparse_lock;
+static uint8_t *sparse_valid;
+static uint64_t sparse_valid_size;
+static uint64_t sparse_valid_blocks;
 
-void
-blkio_write_sparse_clone(DevInfo *dev, void *buf, uint64_t offset, uint64_t count)
+#define sparse_block_valid(b) (sparse_valid[(b) >> 3] & (1 << ((b) & 7)))
+
+/*
+ * Map the bitmap for dev, creating or extending the file if need be.
+ * Returns the bitmap, or 0 if we're running without one.
+ */
+static uint8_t *
+blkio_sparse_valid_map(DevInfo *dev)
 {
-	int bytes;
+	uint64_t size = (dev->blocks+7)/8;
+	struct stat st;
+	void *map;
+	int fd;
 
-	if (lseek(sparse_clone_fd, offset, SEEK_SET) == -1)
+	mutex_lock(&sparse_lock);
+	if (sparse_valid || sparse_valid_failed || size == 0)
 	{
-		sys_error("blkio_write_sparse_clone", "seek to 0x%" PRIx64 " failed", offset);
-		return;
+		mutex_unlock(&sparse_lock);
+		return sparse_valid;
 	}
 
-	if ((bytes = write(sparse_clone_fd, buf, count)) == -1)
+	sparse_valid_failed = 1;
+	if ((fd = open(sparse_valid_path, O_RDWR|O_CREAT, 0666)) == -1)
+	{
+		sys_error("sparse_clone", "couldn't open %s", sparse_valid_path);
+		mutex_unlock(&sparse_lock);
+		return 0;
+	}
+	if (fstat(fd, &st) == -1 || (st.st_size < size && ftruncate(fd, size) == -1))
+	{
+		sys_error("sparse_clone", "couldn't size %s", sparse_valid_path);
+		close(fd);
+		mutex_unlock(&sparse_lock);
+		return 0;
+	}
+	if (st.st_size > size)
+		size = st.st_size;
+	if ((map = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+		sys_error("sparse_clone", "couldn't map %s", sparse_valid_path);
+		close(fd);
+		mutex_unlock(&sparse_lock);
+		return 0;
+	}
+	close(fd);
+
+	sparse_valid_size = size;
+	sparse_valid_blocks = dev->blocks;
+	sparse_valid = map;
+	sparse_valid_failed = 0;
+	mutex_unlock(&sparse_lock);
+
+	return sparse_valid;
+}
+
+/*
+ * Does the clone hold every block of [first, last)?
+ */
+static int
+blkio_sparse_blocks_valid(uint64_t first, uint64_t last)
+{
+	uint64_t b = first;
+
+	if (last > sparse_valid_blocks)
+		return 0;
+
+	while (b < last)
+	{
+		if ((b & 7) == 0 && b+8 <= last)
+		{
+			if (sparse_valid[b >> 3] != 0xff)
+				return 0;
+			b += 8;
+			continue;
+		}
+		if (!sparse_block_valid(b))
+			return 0;
+		b++;
+	}
+	return 1;
+}
+
+static void
+blkio_sparse_mark_valid(uint64_t b)
+{
+	__sync_fetch_and_or(&sparse_valid[b >> 3], 1 << (b & 7));
+}
+
+int
+blkio_sparse_valid(DevInfo *dev, uint64_t offset, uint64_t count)
+{
+	int bs = dev->block_size;
+
+	if (sparse_clone_fd < 0 || count == 0 || blkio_sparse_valid_map(dev) == 0)
+		return 0;
+	return blkio_sparse_blocks_valid(offset/bs, (offset+count+bs-1)/bs);
+}
+
+/*
+ * Serve a read from the clone if it holds all the blocks involved.
+ * Returns 1 if buf has been filled, 0 if the caller should read from the
+ * device.
+ */
+int
+blkio_sparse_read(DevInfo *dev, void *buf, uint64_t offset, uint64_t count)
+{
+	if (!blkio_sparse_valid(dev, offset, count))
+		return 0;
+	return pread(sparse_clone_fd, buf, count, offset) == count;
+}
+
+static int
+blkio_sparse_pwrite(void *buf, uint64_t offset, uint64_t count)
+{
+	ssize_t bytes;
+
+	if ((bytes = pwrite(sparse_clone_fd, buf, count, offset)) == -1)
 	{
 		sys_error("blkio_write_sparse_clone", "write failed");
-		return;
+		return -1;
 	}
 
 	if (bytes < count)
 	{
 		error("blkio_write_sparse_clone", "short write - expected to write 0x%" PRIx64 " bytes, actually wrote 0x%" PRIx64 " bytes", count, bytes);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Write out the blocks of [offset, offset+count) that the clone doesn't
+ * already hold, and mark the whole ones valid. Partial blocks at either
+ * end are written if they aren't valid yet, but not marked.
+ */
+void
+blkio_write_sparse_clone(DevInfo *dev, void *buf, uint64_t offset, uint64_t count)
+{
+	int bs = dev->block_size;
+	uint64_t first = (offset+bs-1)/bs;
+	uint64_t last = (offset+count)/bs;
+	uint64_t start;
+	uint64_t b;
+	int any_bad;
+
+	if (blkio_sparse_valid_map(dev) == 0 || last > sparse_valid_blocks)
+	{
+		blkio_sparse_pwrite(buf, offset, count);
+		return;
+	}
+
+	if (first >= last)
+	{
+		if (!blkio_sparse_blocks_valid(offset/bs, (offset+count+bs-1)/bs))
+			blkio_sparse_pwrite(buf, offset, count);
 		return;
 	}
+
+	if (first*bs > offset && !sparse_block_valid(first-1))
+		blkio_sparse_pwrite(buf, offset, first*bs-offset);
+	if (last*bs < offset+count && !sparse_block_valid(last))
+		blkio_sparse_pwrite((char *)buf+(last*bs-offset), last*bs, offset+count-last*bs);
+
+	any_bad = blkio_bad_blocks(dev, first*bs, (last-first)*bs) > 0;
+	for (b = first; b < last; )
+	{
+		if (sparse_block_valid(b))
+		{
+			b++;
+			continue;
+		}
+		for (start = b; b < last && !sparse_block_valid(b); b++)
+			;
+		if (blkio_sparse_pwrite((char *)buf+(start*bs-offset), start*bs, (b-start)*bs) < 0)
+			return;
+		for (; start < b; start++)
+			if (!any_bad || blkio_bad_blocks(dev, start*bs, bs) == 0)
+				blkio_sparse_mark_valid(start);
+	}
 }
 
 void
 blkio_open_sparse_clone(char *path)
 {
-	if ((sparse_clone_fd = open(path, O_WRONLY|O_CREAT, 0666)) == -1)
+	if ((sparse_clone_fd = open(path, O_RDWR|O_CREAT, 0666)) == -1)
 	{
 		sys_error("sparse_clone", "couldn't open %s", path);
 		return;
 	}
+	if ((sparse_valid_path = malloc(strlen(path)+sizeof(".valid"))) == 0)
+	{
+		no_memory("sparse_clone");
+		close(sparse_clone_fd);
+		sparse_clone_fd = -1;
+		return;
+	}
+	sprintf(sparse_valid_path, "%s.valid", path);
+	mutex_init(&sparse_lock);
 	blkio_each_block_fn(blkio_write_sparse_clone);
 }
 
 void
 blkio_close_sparse_clone()
 {
+	blkio_each_block_fn(0);
+	if (sparse_valid)
+		munmap(sparse_valid, sparse_valid_size);
+	sparse_valid = 0;
+	sparse_valid_size = sparse_valid_blocks = 0;
+	sparse_valid_failed = 0;
+	if (sparse_valid_path)
+	{
+		free(sparse_valid_path);
+		sparse_valid_path = 0;
+		mutex_destroy(&sparse_lock);
+	}
 	if (sparse_clone_fd >= 0)
 		close(sparse_clone_fd);
-	sparse_clone_fd = 0;
+	sparse_clone_fd = -1;
 }
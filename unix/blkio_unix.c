@@ -20,29 +20,43 @@
  */
 
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <linux/fs.h>
 
 #include "port.h"
 #include "common.h"
 #include "blkio.h"
+#include "stats.h"
 
 #include "blkio_unix.h"
 
 #define DEFAULT_BLOCK_SIZE 512
 
-struct DevInfo
-{
-	char *path;
-	int fd;
-	int block_size;
-	uint64_t blocks;
-	uint64_t bytes;
-};
+/*
+ * Alignment of buffers handed out by blkio_buffer_alloc(). This is more
+ * than any O_DIRECT implementation needs and keeps buffers page aligned.
+ */
+#define BUFFER_ALIGN 4096
+
+/*
+ * Number of idle buffers kept in each device's pool.
+ */
+#define MAX_POOL_BUFFERS 16
+
+typedef struct BlkioFreeBuffer {
+	struct BlkioFreeBuffer *next;
+	int size;
+} BlkioFreeBuffer;
 
 static uint64_t size_override = 0;
+static int direct_io = 0;
 
 void
 blkio_set_size_override(uint64_t size)
@@ -52,6 +66,67 @@ blkio_set_size_override(uint64_t size)
 			format_disk_size(size_override));
 }
 
+/*
+ * In direct IO mode reads bypass the host's page cache, so copying a
+ * multi-gigabyte recording doesn't evict everything else from memory.
+ * Reads that don't meet the O_DIRECT alignment rules (small metadata
+ * reads into malloc'd buffers, the tail of a file) still go through the
+ * ordinary descriptor.
+ */
+void
+blkio_set_direct_io(int on)
+{
+	direct_io = on;
+}
+
+static DevInfo *
+blkio_open_finish(DevInfo *dev)
+{
+	dev->direct_fd = -1;
+	dev->direct_align = dev->block_size;
+	if (direct_io && !dev->chunked)
+	{
+		if ((dev->direct_fd = open(dev->path, O_RDONLY|O_DIRECT)) == -1)
+			fprintf(stderr, "warning: direct IO not supported on '%s'\n", dev->path);
+	}
+
+	pthread_mutex_init(&dev->pool_lock, 0);
+	dev->pool = 0;
+	dev->pool_count = 0;
+	dev->ra = 0;
+
+	return dev;
+}
+
+/*
+ * Disk images and sparse clones are mapped into memory, so reads are
+ * served without a system call. In direct IO mode we want to stay out
+ * of the page cache, and in rescue mode we need to see read errors, so
+ * we don't map. If mapping fails (a 32-bit host with a large image, say)
+ * we just use pread().
+ */
+static void
+blkio_map_image(DevInfo *dev, uint64_t file_size)
+{
+	dev->map = 0;
+	dev->map_size = 0;
+
+	if (direct_io || file_size == 0 || file_size != (size_t)file_size)
+		return;
+
+	/* A read error on a mapped file would be a SIGBUS. */
+	if (blkio_rescue_enabled())
+		return;
+
+	dev->map = mmap(0, file_size, PROT_READ, MAP_SHARED, dev->fd, 0);
+	if (dev->map == MAP_FAILED)
+	{
+		dev->map = 0;
+		return;
+	}
+	dev->map_size = file_size;
+}
+
 DevInfo *
 blkio_open(char *path)
 {
@@ -72,6 +147,9 @@ blkio_open(char *path)
 	}
 
 	dev->path = path;
+	dev->map = 0;
+	dev->map_size = 0;
+	dev->chunked = 0;
 	if ((dev->fd = open(path, O_RDONLY)) == -1)
 	{
 		sys_error("blkio_open", "could not open '%s'", path);
@@ -90,10 +168,21 @@ blkio_open(char *path)
 	{
 		uint64_t size = size_override? size_override : dev_stat.st_size;
 
+		switch (blkio_chunked_probe(dev))
+		{
+		case 1:
+			return blkio_open_finish(dev);
+		case -1:
+			close(dev->fd);
+			free(dev);
+			return 0;
+		}
+
 		dev->block_size = DEFAULT_BLOCK_SIZE;
 		dev->blocks = size/dev->block_size;
 		dev->bytes = size;
-		return dev;
+		blkio_map_image(dev, dev_stat.st_size);
+		return blkio_open_finish(dev);
 	}
 	else if (S_ISBLK(dev_stat.st_mode))
 	{
@@ -121,7 +210,7 @@ blkio_open(char *path)
 			dev->bytes = dev_size;
 		}
 
-		return dev;
+		return blkio_open_finish(dev);
 	}
 
 	error("blkio_open", "not a file or block device");
@@ -132,11 +221,81 @@ blkio_open(char *path)
 void
 blkio_close(DevInfo *dev)
 {
+	BlkioFreeBuffer *b;
+
+	blkio_readahead_close(dev);
+	blkio_chunked_close(dev);
+	while ((b = dev->pool) != 0)
+	{
+		dev->pool = b->next;
+		free(b);
+	}
+	pthread_mutex_destroy(&dev->pool_lock);
+
+	if (dev->map)
+		munmap(dev->map, dev->map_size);
+	if (dev->direct_fd >= 0)
+		close(dev->direct_fd);
 	if (close(dev->fd) == -1)
 		sys_error("blkio_close", "close failed");
 	free(dev);
 }
 
+/*
+ * Buffers suitable for direct IO. Freed buffers are kept on a short list
+ * for reuse, as file handles come and go for every file we touch.
+ */
+void *
+blkio_buffer_alloc(DevInfo *dev, int size)
+{
+	BlkioFreeBuffer **bp;
+	BlkioFreeBuffer *b;
+	void *buf;
+
+	pthread_mutex_lock(&dev->pool_lock);
+	for (bp = &dev->pool; (b = *bp) != 0; bp = &b->next)
+	{
+		if (b->size == size)
+		{
+			*bp = b->next;
+			dev->pool_count--;
+			pthread_mutex_unlock(&dev->pool_lock);
+			return b;
+		}
+	}
+	pthread_mutex_unlock(&dev->pool_lock);
+
+	if (posix_memalign(&buf, BUFFER_ALIGN, size < sizeof(BlkioFreeBuffer)? sizeof(BlkioFreeBuffer) : size) != 0)
+	{
+		no_memory("blkio_buffer_alloc");
+		return 0;
+	}
+
+	return buf;
+}
+
+void
+blkio_buffer_free(DevInfo *dev, void *buf, int size)
+{
+	BlkioFreeBuffer *b = (BlkioFreeBuffer *)buf;
+
+	if (!buf)
+		return;
+
+	pthread_mutex_lock(&dev->pool_lock);
+	if (dev->pool_count < MAX_POOL_BUFFERS)
+	{
+		b->size = size;
+		b->next = dev->pool;
+		dev->pool = b;
+		dev->pool_count++;
+		buf = 0;
+	}
+	pthread_mutex_unlock(&dev->pool_lock);
+
+	free(buf);
+}
+
 void
 blkio_describe(DevInfo *dev, char *str, int size)
 {
@@ -159,45 +318,213 @@ blkio_total_blocks(DevInfo *dev)
 	return dev->blocks;
 }
 
+/*
+ * The each block hook is called by whichever thread completed the read,
+ * so it must itself be safe to call concurrently. The lock only stops
+ * the hook being swapped out from under a read that is calling it.
+ */
 static EachBlockFn each_block_fn;
+static pthread_rwlock_t each_block_lock = PTHREAD_RWLOCK_INITIALIZER;
 
 void
 blkio_each_block_fn(EachBlockFn fn)
 {
+	pthread_rwlock_wrlock(&each_block_lock);
 	each_block_fn = fn;
+	pthread_rwlock_unlock(&each_block_lock);
 }
 
-uint64_t
-blkio_read(DevInfo *dev, void *buf, uint64_t offset, uint64_t count)
+static void
+blkio_call_each_block_fn(DevInfo *dev, void *buf, uint64_t offset, uint64_t count)
 {
-	int bytes;
+	pthread_rwlock_rdlock(&each_block_lock);
+	if (each_block_fn)
+		each_block_fn(dev, buf, offset, count);
+	pthread_rwlock_unlock(&each_block_lock);
+}
 
-	if (offset > dev->bytes)
+/*
+ * Pick the descriptor to read with: the O_DIRECT one if we have it and
+ * the request is suitably aligned.
+ */
+int
+blkio_fd_for(DevInfo *dev, void *buf, uint64_t offset, uint64_t count)
+{
+	if (dev->direct_fd >= 0
+		&& (((uintptr_t)buf | offset | count) & (dev->direct_align-1)) == 0)
+		return dev->direct_fd;
+	return dev->fd;
+}
+
+static int64_t
+blkio_pread_fd(DevInfo *dev, void *buf, uint64_t offset, uint64_t count)
+{
+	uint64_t bytes = 0;
+	ssize_t n;
+	int fd = blkio_fd_for(dev, buf, offset, count);
+
+	while (bytes < count)
 	{
-		error("blkio_read", "offset 0x%" PRIx64 " > disk size 0x%" PRIx64, offset, dev->bytes);
-		return -1;
+		if ((n = pread(fd, (char *)buf+bytes, count-bytes, offset+bytes)) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			/* Direct IO constraints vary by filesystem; retry buffered. */
+			if (errno == EINVAL && fd != dev->fd)
+			{
+				fd = dev->fd;
+				continue;
+			}
+			return -errno;
+		}
+		if (n == 0)
+			break;
+		bytes += n;
 	}
 
-	if (lseek(dev->fd, offset, SEEK_SET) == -1)
+	return bytes;
+}
+
+/*
+ * Read using pread() so that no file offset is shared between callers:
+ * any number of threads may be reading from one DevInfo at once.
+ * Returns the number of bytes read, which is only less than count at the
+ * end of the device, or -errno. Doesn't set the error message or call
+ * the each block hook. Every read that reaches the device comes through
+ * here, so this is where device statistics are gathered.
+ */
+int64_t
+blkio_pread(DevInfo *dev, void *buf, uint64_t offset, uint64_t count)
+{
+	uint64_t start = stats_start();
+	int64_t result;
+
+	if (dev->chunked)
+		result = blkio_chunked_read(dev, buf, offset, count);
+	else
+		result = blkio_pread_fd(dev, buf, offset, count);
+	stats_device_read(start, offset, count, result);
+
+	return result;
+}
+
+/*
+ * Returns a pointer to the raw device data if the range is mapped into
+ * memory, otherwise 0 and the caller should use blkio_read(). The data
+ * is passed to the each block hook as if it had been read.
+ */
+void *
+blkio_map(DevInfo *dev, uint64_t offset, uint64_t count)
+{
+	void *p;
+
+	if (!dev->map || offset > dev->map_size || count > dev->map_size-offset)
+		return 0;
+
+	p = (char *)dev->map + offset;
+	stats_blkio_read(stats_start(), STATS_FROM_MAP, count, 1);
+	blkio_call_each_block_fn(dev, p, offset, count);
+
+	return p;
+}
+
+/*
+ * blkio_read() goes in three steps, which the asynchronous reads in
+ * blkio_async.c share so that they find data in the same places and are
+ * counted and reported in the same way. blkio_read_start() serves the
+ * read without going to the device if it can, from the mapping, the clone
+ * or readahead: it returns 1 if it did, 0 if the device has to be read
+ * and -1 if the request is out of range. blkio_read_device() then reads
+ * the device, through rescue mode if that's on. blkio_read_finish()
+ * gathers statistics, reports a failed or short read and calls the each
+ * block hook, and returns 1 if the whole request was read.
+ */
+int
+blkio_read_start(DevInfo *dev, BlkioRequest *req)
+{
+	req->start = stats_start();
+	req->result = 0;
+
+	if (req->offset > dev->bytes)
 	{
-		sys_error("blkio_read", "seek to 0x%" PRIx64 " failed", offset);
+		error("blkio_read", "offset 0x%" PRIx64 " > disk size 0x%" PRIx64, req->offset, dev->bytes);
 		return -1;
 	}
 
-	if ((bytes = read(dev->fd, buf, count)) == -1)
+	if (dev->map && req->offset <= dev->map_size && req->count <= dev->map_size-req->offset)
 	{
-		sys_error("blkio_read", "read failed");
-		return -1;
+		memcpy(req->buf, (char *)dev->map + req->offset, req->count);
+		req->source = STATS_FROM_MAP;
 	}
+	else if (blkio_sparse_read(dev, req->buf, req->offset, req->count))
+		req->source = STATS_FROM_CLONE;
+	else if (blkio_readahead_take(dev, req->buf, req->offset, req->count))
+		req->source = STATS_FROM_READAHEAD;
+	else
+	{
+		req->source = STATS_FROM_DEVICE;
+		return 0;
+	}
+
+	req->result = req->count;
+	return 1;
+}
 
-	if (bytes < count)
+void
+blkio_read_device(DevInfo *dev, BlkioRequest *req)
+{
+	if (blkio_rescue_enabled() && req->count <= dev->bytes-req->offset)
 	{
-		error("blkio_read", "short read - wanted 0x%" PRIx64 " bytes, got 0x%" PRIx64 " bytes", count, bytes);
-		return -1;
+		req->source = STATS_FROM_RESCUE;
+		req->result = blkio_rescue_read(dev, req->buf, req->offset, req->count);
+	}
+	else
+	{
+		req->source = STATS_FROM_DEVICE;
+		req->result = blkio_pread(dev, req->buf, req->offset, req->count);
 	}
+}
 
-	if (each_block_fn)
-		each_block_fn(dev, buf, offset, count);
+int
+blkio_read_finish(DevInfo *dev, BlkioRequest *req)
+{
+	if (req->result < 0)
+	{
+		stats_blkio_read(req->start, req->source, 0, 0);
+		errno = -req->result;
+		sys_error("blkio_read", "read at 0x%" PRIx64 " failed", req->offset);
+		return 0;
+	}
 
-	return bytes;
+	stats_blkio_read(req->start, req->source, req->result, req->result == req->count);
+
+	if (req->result < req->count)
+	{
+		error("blkio_read", "short read - wanted 0x%" PRIx64 " bytes, got 0x%" PRIx64 " bytes", req->count, req->result);
+		return 0;
+	}
+
+	blkio_call_each_block_fn(dev, req->buf, req->offset, req->count);
+
+	return 1;
+}
+
+uint64_t
+blkio_read(DevInfo *dev, void *buf, uint64_t offset, uint64_t count)
+{
+	BlkioRequest req;
+	int r;
+
+	req.buf = buf;
+	req.offset = offset;
+	req.count = count;
+
+	if ((r = blkio_read_start(dev, &req)) == -1)
+		return -1;
+	if (r == 0)
+		blkio_read_device(dev, &req);
+	if (!blkio_read_finish(dev, &req))
+		return -1;
+
+	return count;
 }
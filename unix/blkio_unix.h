@@ -19,13 +19,68 @@
  * along with HDSave.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+typedef struct BlkioReadahead BlkioReadahead;
+typedef struct BlkioChunked BlkioChunked;
+
+/*
+ * Private to the Unix block IO modules. Nothing in here changes after
+ * blkio_open() returns, apart from the buffer pool, which has its own
+ * lock, and the readahead state, which is created on first use under
+ * the same lock.
+ */
+struct DevInfo
+{
+	char *path;
+	int fd;
+	int direct_fd;
+	int direct_align;
+	int block_size;
+	uint64_t blocks;
+	uint64_t bytes;
+	void *map;
+	uint64_t map_size;
+	pthread_mutex_t pool_lock;
+	struct BlkioFreeBuffer *pool;
+	int pool_count;
+	BlkioReadahead *ra;
+	BlkioChunked *chunked;
+};
+
 typedef void (*EachBlockFn)(DevInfo *dev, void *buf, uint64_t offset, uint64_t count);
 
 /* blkio_unix.c */
 
+extern void blkio_set_direct_io(int on);
 extern void blkio_each_block_fn(EachBlockFn fn);
+extern int blkio_fd_for(DevInfo *dev, void *buf, uint64_t offset, uint64_t count);
+extern int64_t blkio_pread(DevInfo *dev, void *buf, uint64_t offset, uint64_t count);
+extern int blkio_read_start(DevInfo *dev, BlkioRequest *req);
+extern void blkio_read_device(DevInfo *dev, BlkioRequest *req);
+extern int blkio_read_finish(DevInfo *dev, BlkioRequest *req);
+
+/* blkio_chunked.c */
+
+extern int blkio_chunked_probe(DevInfo *dev);
+extern void blkio_chunked_close(DevInfo *dev);
+extern int64_t blkio_chunked_read(DevInfo *dev, void *buf, uint64_t offset, uint64_t count);
+extern void blkio_open_chunked_clone(char *path);
+extern void blkio_close_chunked_clone(void);
+
+/* blkio_readahead.c */
+
+extern int blkio_readahead_take(DevInfo *dev, void *buf, uint64_t offset, uint64_t count);
+extern void blkio_readahead_close(DevInfo *dev);
+
+/* blkio_rescue.c */
+
+extern void blkio_open_rescue(char *path, int retry);
+extern void blkio_close_rescue(void);
+extern int blkio_rescue_enabled(void);
+extern int64_t blkio_rescue_read(DevInfo *dev, void *buf, uint64_t offset, uint64_t count);
 
 /* blkio_sparse.c */
 
 extern void blkio_open_sparse_clone(char *path);
 extern void blkio_close_sparse_clone();
+extern int blkio_sparse_valid(DevInfo *dev, uint64_t offset, uint64_t count);
+extern int blkio_sparse_read(DevInfo *dev, void *buf, uint64_t offset, uint64_t count);
@@ -21,12 +21,17 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <time.h>
 
 #include "port.h"
 #include "common.h"
 
-static char fmt_buffer[160];
-static char error_buffer[160];
+/*
+ * Per-thread so that a failure reported by one reading thread can't be
+ * overwritten by another before the caller gets to print it.
+ */
+static __thread char fmt_buffer[160];
+static __thread char error_buffer[160];
 
 void
 sys_error(char *where, char *fmt, ...)
@@ -87,3 +92,15 @@ fatal(char *where, char *fmt, ...)
 	va_end(ap);
 	fputs("\n", stderr);
 }
+
+/*
+ * Monotonic time in nanoseconds, for timing operations.
+ */
+uint64_t
+clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
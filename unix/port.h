@@ -24,6 +24,17 @@
 #include <stdarg.h>
 #include <inttypes.h>
 #include <byteswap.h>
+#include <pthread.h>
+
+/*
+ * Locking, for the few structures that are shared between threads.
+ */
+typedef pthread_mutex_t mutex_t;
+
+#define mutex_init(m)		pthread_mutex_init((m), 0)
+#define mutex_destroy(m)	pthread_mutex_destroy(m)
+#define mutex_lock(m)		pthread_mutex_lock(m)
+#define mutex_unlock(m)		pthread_mutex_unlock(m)
 
 /*
  * Error function specifically for Unix system call failures.
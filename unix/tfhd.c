@@ -20,15 +20,20 @@
  */
 
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
 
 #include "port.h"
 #include "common.h"
 #include "blkio.h"
 #include "fs.h"
+#include "stats.h"
 
 #include "blkio_unix.h"
 
@@ -40,12 +45,22 @@ static int info_cmd(int argc, char *argv[]);
 static int ls_cmd(int argc, char *argv[]);
 static int cp_cmd(int argc, char *argv[]);
 static int map_cmd(int argc, char *argv[]);
+static int which_cmd(int argc, char *argv[]);
+static int fsck_cmd(int argc, char *argv[]);
+static int frag_cmd(int argc, char *argv[]);
 
 typedef struct {
 	char *device_path;
 	char *disk_map;
 	char *size_override;
 	char *sparse_clone;
+	char *chunked_clone;
+	int direct_io;
+	char *bad_blocks;
+	int retry_bad_blocks;
+	int verify_fat;
+	int stats;
+	int stats_json;
 	CommandFn command_fn;
 } Options;
 
@@ -61,6 +76,9 @@ static Command commands[] = {
         { "ls", ls_cmd },
         { "cp", cp_cmd },
         { "map", map_cmd },
+        { "which", which_cmd },
+        { "fsck", fsck_cmd },
+        { "frag", frag_cmd },
 };
 
 static void
@@ -72,21 +90,35 @@ usage(void)
 	fputs("\t-m FILE\t\tUse a previously saved map file\n", stderr);
 	fputs("\t-s SIZE\t\tSet disk size instead of probing device\n", stderr);
 	fputs("\t-c FILE\t\tCopy each block accessed to sparse clone FILE\n", stderr);
+	fputs("\t-z FILE\t\tCopy each chunk accessed to compressed clone FILE\n", stderr);
+	fputs("\t-d\t\tUse direct IO, bypassing the host's page cache\n", stderr);
+	fputs("\t-r FILE\t\tRescue mode: zero fill unreadable blocks, listing them in FILE\n", stderr);
+	fputs("\t-R\t\tIn rescue mode, retry blocks already listed as bad\n", stderr);
+	fputs("\t-V\t\tRefuse to use a FAT that fails its CRC check\n", stderr);
+	fputs("\t--stats[=json]\tPrint IO statistics on exit, as text or JSON\n", stderr);
 	fputs("commands:\n", stderr);
 	fputs("\tinfo\t\tPrint basic information about the disk\n", stderr);
 	fputs("\tls [dir]\tList contents of a directory\n", stderr);
-	fputs("\tcp <src> <dst>\tCopy contents of a file to host filesystem\n", stderr);
+	fputs("\tcp [-n N] <src> <dst>\n\t\t\tCopy contents of a file to host filesystem,\n\t\t\treading up to N buffers ahead of the writes\n", stderr);
 	fputs("\tmap <file>\tWrite a disk map to <file>\n", stderr);
+	fputs("\tfsck\t\tCheck the filesystem for damage\n", stderr);
+	fputs("\tfrag [-a]\tReport free space and fragmented files (-a: all files)\n", stderr);
+	fputs("\twhich [-b|-B] [N...]\n\t\t\tShow which files hold clusters N, or byte (-b) or\n\t\t\tblock (-B) offsets N, read from stdin if not given\n", stderr);
 	exit(EXIT_FAILURE);
 }
 
+static struct option long_options[] = {
+	{ "stats", optional_argument, 0, 'S' },
+	{ 0, 0, 0, 0 }
+};
+
 static int
 parse_options(int argc, char *argv[])
 {
 	int opt;
 	int i;
 
-	while ((opt = getopt(argc, argv, "+f:m:s:c:")) != -1)
+	while ((opt = getopt_long(argc, argv, "+f:m:s:c:z:dr:RV", long_options, 0)) != -1)
 	{
 		switch (opt)
 		{
@@ -102,11 +134,39 @@ parse_options(int argc, char *argv[])
 		case 'c':
 			opts.sparse_clone = optarg;
 			break;
+		case 'z':
+			opts.chunked_clone = optarg;
+			break;
+		case 'd':
+			opts.direct_io = 1;
+			break;
+		case 'r':
+			opts.bad_blocks = optarg;
+			break;
+		case 'R':
+			opts.retry_bad_blocks = 1;
+			break;
+		case 'V':
+			opts.verify_fat = 1;
+			break;
+		case 'S':
+			opts.stats = 1;
+			if (optarg && strcmp(optarg, "json") == 0)
+				opts.stats_json = 1;
+			else if (optarg && strcmp(optarg, "text") != 0)
+				usage();
+			break;
 		default:
 			usage();
 		}
 	}
 
+	if (opts.sparse_clone && opts.chunked_clone)
+	{
+		fputs("tfhd: -c and -z can't be used together\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
 	if (optind >= argc)
 		usage();
 	for (i = 0; i < elementsof(commands); i++)
@@ -141,9 +201,24 @@ main(int argc, char *argv[])
 		blkio_set_size_override(size);
 	}
 
+	if (opts.direct_io)
+		blkio_set_direct_io(1);
+
+	if (opts.stats)
+		stats_enable();
+
+	if (opts.verify_fat)
+		fs_fat_set_verify(1);
+
+	if (opts.bad_blocks)
+		blkio_open_rescue(opts.bad_blocks, opts.retry_bad_blocks);
+
 	if (opts.sparse_clone)
 		blkio_open_sparse_clone(opts.sparse_clone);
 
+	if (opts.chunked_clone)
+		blkio_open_chunked_clone(opts.chunked_clone);
+
 	if (opts.command_fn)
 	{
 		if ((disk = disk_open(opts.device_path)) == 0)
@@ -152,6 +227,8 @@ main(int argc, char *argv[])
 		        success = 0;
 		if (success)
 			success = opts.command_fn(argc, argv);
+		if (disk && opts.stats)
+			stats_print(stderr, opts.stats_json, disk->cache);
 		if (fs)
 			fs_close(fs);
 		if (disk)
@@ -165,6 +242,12 @@ main(int argc, char *argv[])
 	if (opts.sparse_clone)
 		blkio_close_sparse_clone();
 
+	if (opts.chunked_clone)
+		blkio_close_chunked_clone();
+
+	if (opts.bad_blocks)
+		blkio_close_rescue();
+
 	if (success)
 	{
 		return 0;
@@ -220,28 +303,419 @@ ls_cmd(int argc, char *argv[])
 	return r;
 }
 
+/*
+ * In direct IO mode the output file is opened with O_DIRECT too. The
+ * last write of a file is usually not a whole number of blocks, and some
+ * filesystems have stricter alignment rules than we can meet, so if a
+ * direct write is refused we drop O_DIRECT and carry on.
+ */
+static int
+cp_open(char *path)
+{
+	int fd;
+
+	if (opts.direct_io)
+	{
+		if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_DIRECT, 0666)) != -1)
+			return fd;
+	}
+
+	return open(path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+}
+
+static int
+cp_write(int fd, char *buf, int bytes)
+{
+	int n;
+
+	while (bytes > 0)
+	{
+		if ((n = write(fd, buf, bytes)) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EINVAL && (fcntl(fd, F_GETFL) & O_DIRECT))
+			{
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+				continue;
+			}
+			return -1;
+		}
+		buf += n;
+		bytes -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * cp normally runs as a pipeline: a reader thread fills a ring of buffers
+ * from the disk while this thread writes them out, so the disk and the
+ * destination are busy at the same time and the copy runs at the speed
+ * of the slower of the two rather than their combined time.
+ *
+ * The byte swap is done by whichever side has time for it. If the ring
+ * is filling up the writer is the bottleneck, so the reader swaps each
+ * buffer before handing it over; otherwise it leaves the swap to the
+ * writer.
+ */
+
+#define CP_DEPTH 4
+
+#define CP_BUFFER_SIZE (8*1024*1024)
+
+/*
+ * The reader doesn't wait for one read to finish before asking for the
+ * next. Each contiguous run of the file is read in requests of up to
+ * CP_REQUEST_SIZE through an asynchronous queue that keeps up to
+ * CP_QUEUE_DEPTH of them in flight, running on into the next buffer
+ * while the last of one are still being read, so the drive always has
+ * the next request waiting.
+ */
+#define CP_QUEUE_DEPTH 16
+#define CP_REQUEST_SIZE (1024*1024)
+
+typedef struct {
+	char *buf;
+	int bytes;
+	int swapped;
+	int pending;		/* requests in flight, for the reader */
+} CpSlot;
+
+typedef struct {
+	FileHandle *file;
+	int depth;
+	int buffer_size;
+	CpSlot *slots;
+	BlkioQueue *queue;
+	BlkioRequest reqs[CP_QUEUE_DEPTH];
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	int filled;		/* slots waiting for the writer */
+	int reader_done;
+	int read_failed;
+	int write_failed;
+	char read_error[160];
+} CpPipe;
+
+static void *
+cp_reader(void *arg)
+{
+	CpPipe *p = (CpPipe *)arg;
+	FileHandle *file = p->file;
+	int block_size = file->fs->block_size;
+	BlkioRequest *free_reqs[CP_QUEUE_DEPTH];
+	BlkioRequest *batch[CP_QUEUE_DEPTH];
+	BlkioRequest *done[CP_QUEUE_DEPTH];
+	int num_free = CP_QUEUE_DEPTH;
+	int num_batch;
+	CpSlot *slot = 0;	/* the buffer reads are being started in */
+	CpSlot *oldest;
+	int first = 0;		/* the oldest buffer the reader has */
+	int next = 0;
+	int reading = 0;	/* buffers the reader has */
+	BlkioRequest *req;
+	int cluster;
+	int cluster_offset;
+	uint64_t bytes;
+	int failed;
+	int n;
+	int i;
+
+	for (i = 0; i < CP_QUEUE_DEPTH; i++)
+		free_reqs[i] = &p->reqs[i];
+
+	pthread_mutex_lock(&p->lock);
+	for (;;)
+	{
+		/*
+		 * Hand finished buffers to the writer, in order. The last
+		 * one of the file may not be full.
+		 */
+		while (reading > 0 && (oldest = &p->slots[first])->pending == 0
+			&& (oldest != slot || file->offset >= file->filesize))
+		{
+			if (oldest == slot)
+				slot = 0;
+			oldest->swapped = p->filled >= p->depth/2;
+			if (oldest->swapped)
+			{
+				pthread_mutex_unlock(&p->lock);
+				fs_swap_bytes(oldest->buf, (oldest->bytes+3) & ~3);
+				pthread_mutex_lock(&p->lock);
+			}
+			first = (first+1) % p->depth;
+			reading--;
+			p->filled++;
+			pthread_cond_signal(&p->changed);
+		}
+
+		if (p->write_failed || (reading == 0 && file->offset >= file->filesize))
+			break;
+
+		/* Start as many reads as the queue and the free buffers allow. */
+		num_batch = 0;
+		while (num_free > 0 && file->offset < file->filesize)
+		{
+			if (!slot)
+			{
+				if (p->filled + reading == p->depth)
+					break;
+				slot = &p->slots[next];
+				slot->bytes = 0;
+				slot->pending = 0;
+				next = (next+1) % p->depth;
+				reading++;
+			}
+			bytes = p->buffer_size - slot->bytes;
+			if (bytes > CP_REQUEST_SIZE)
+				bytes = CP_REQUEST_SIZE;
+			bytes = file_next_span(file, bytes, &cluster, &cluster_offset);
+			req = free_reqs[--num_free];
+			req->buf = slot->buf + slot->bytes;
+			req->offset = fs_disk_offset(file->fs, cluster, cluster_offset);
+			req->count = (bytes+block_size-1) & ~(uint64_t)(block_size-1);
+			req->arg = slot;
+			batch[num_batch++] = req;
+			slot->bytes += bytes;
+			slot->pending++;
+			if (slot->bytes == p->buffer_size)
+				slot = 0;
+		}
+
+		/* With nothing in flight, we're waiting for the writer. */
+		if (num_free == CP_QUEUE_DEPTH)
+		{
+			pthread_cond_wait(&p->changed, &p->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&p->lock);
+
+		failed = num_batch > 0 && blkio_submit(p->queue, batch, num_batch) != num_batch;
+		if (!failed)
+		{
+			failed = (n = blkio_reap(p->queue, done, 1, CP_QUEUE_DEPTH)) < 0;
+			for (i = 0; i < n; i++)
+			{
+				if (done[i]->result < 0)
+					failed = 1;
+				((CpSlot *)done[i]->arg)->pending--;
+				free_reqs[num_free++] = done[i];
+			}
+		}
+
+		pthread_mutex_lock(&p->lock);
+		if (failed)
+		{
+			p->read_failed = 1;
+			snprintf(p->read_error, sizeof(p->read_error), "%s", get_error());
+			break;
+		}
+	}
+
+	/*
+	 * Every way out of the loop leaves us holding the lock. Reads still
+	 * in flight are waited for when cp_pipeline() closes the queue.
+	 */
+	p->reader_done = 1;
+	pthread_cond_signal(&p->changed);
+	pthread_mutex_unlock(&p->lock);
+
+	return 0;
+}
+
+/*
+ * Big enough for the whole file, up to CP_BUFFER_SIZE.
+ */
+static int
+cp_buffer_size(FileHandle *file)
+{
+	if (file->filesize >= CP_BUFFER_SIZE)
+		return CP_BUFFER_SIZE;
+	return (file->filesize+4095) & ~4095;
+}
+
+/*
+ * Returns 0 on success, -1 if a read failed and -2 if a write failed.
+ */
+static int
+cp_pipeline(FileHandle *file, int fd, int depth)
+{
+	DevInfo *dev = file->fs->disk->dev;
+	CpPipe p;
+	CpSlot *slot;
+	pthread_t reader;
+	int next = 0;
+	int result = 0;
+	int i;
+
+	memset(&p, 0, sizeof(p));
+	p.file = file;
+	p.depth = depth;
+	p.buffer_size = cp_buffer_size(file);
+	if ((p.slots = malloc(depth*sizeof(CpSlot))) == 0)
+	{
+		no_memory("cp");
+		return -1;
+	}
+	memset(p.slots, 0, depth*sizeof(CpSlot));
+	if ((p.queue = blkio_queue_open(dev, CP_QUEUE_DEPTH)) == 0)
+	{
+		result = -1;
+		goto out;
+	}
+	for (i = 0; i < depth; i++)
+	{
+		if ((p.slots[i].buf = blkio_buffer_alloc(dev, p.buffer_size)) == 0)
+		{
+			no_memory("cp");
+			result = -1;
+			goto out;
+		}
+	}
+	pthread_mutex_init(&p.lock, 0);
+	pthread_cond_init(&p.changed, 0);
+
+	if (pthread_create(&reader, 0, cp_reader, &p) != 0)
+	{
+		error("cp", "couldn't start reader thread");
+		result = -1;
+		goto out_sync;
+	}
+
+	for (;;)
+	{
+		pthread_mutex_lock(&p.lock);
+		while (p.filled == 0 && !p.reader_done)
+			pthread_cond_wait(&p.changed, &p.lock);
+		if (p.filled == 0)
+		{
+			pthread_mutex_unlock(&p.lock);
+			break;
+		}
+		pthread_mutex_unlock(&p.lock);
+
+		slot = &p.slots[next];
+		if (!slot->swapped)
+			fs_swap_bytes(slot->buf, (slot->bytes+3) & ~3);
+		if (cp_write(fd, slot->buf, slot->bytes) == -1)
+		{
+			pthread_mutex_lock(&p.lock);
+			p.write_failed = 1;
+			pthread_cond_signal(&p.changed);
+			pthread_mutex_unlock(&p.lock);
+			result = -2;
+			break;
+		}
+		next = (next+1) % depth;
+
+		pthread_mutex_lock(&p.lock);
+		p.filled--;
+		pthread_cond_signal(&p.changed);
+		pthread_mutex_unlock(&p.lock);
+	}
+
+	pthread_join(reader, 0);
+	if (result == 0 && p.read_failed)
+	{
+		error("cp", "%s", p.read_error);
+		result = -1;
+	}
+
+out_sync:
+	pthread_cond_destroy(&p.changed);
+	pthread_mutex_destroy(&p.lock);
+out:
+	if (p.queue)
+		blkio_queue_close(p.queue);
+	for (i = 0; i < depth; i++)
+		blkio_buffer_free(dev, p.slots[i].buf, p.buffer_size);
+	free(p.slots);
+	return result;
+}
+
+/*
+ * The simple way, for a depth of 1.
+ */
+static int
+cp_serial(FileHandle *file, int fd)
+{
+	DevInfo *dev = file->fs->disk->dev;
+	int size = cp_buffer_size(file);
+	char *buf;
+	int64_t n;
+	int result = 0;
+
+	if ((buf = blkio_buffer_alloc(dev, size)) == 0)
+	{
+		no_memory("cp");
+		return -1;
+	}
+	while ((n = file_read_into(file, buf, size, 1)) > 0)
+	{
+		if (cp_write(fd, buf, n) == -1)
+		{
+			result = -2;
+			break;
+		}
+	}
+	if (n < 0)
+		result = -1;
+	blkio_buffer_free(dev, buf, size);
+	return result;
+}
+
 static int
 cp_cmd(int argc, char *argv[])
 {
 	FileHandle *file;
 	int fd;
+	int opt;
+	int depth = CP_DEPTH;
+	int r;
+	uint64_t bad;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			depth = atoi(optarg);
+			break;
+		default:
+			depth = 0;
+		}
+	}
+	if (depth < 1 || argc-optind != 2)
+	{
+		fprintf(stderr, "usage: cp [-n buffers] <src> <dst>\n");
+		error("cp", "bad arguments");
+		return 0;
+	}
+	argv += optind-1;
 
 	if ((file = file_open_pathname(fs, 0, argv[1])) == 0)
 		return 0;
-	if ((fd = creat(argv[2], 0666)) == -1)
+	if ((fd = cp_open(argv[2])) == -1)
 	{
 		sys_error("cp", "could not open '%s' for writing", argv[2]);
+		file_close(file);
 		return 0;
 	}
 
-	while (file_read(file) > 0)
+	r = file->is_dir || depth == 1? cp_serial(file, fd) : cp_pipeline(file, fd, depth);
+	if (r == -2)
 	{
-		if (write(fd, file->buffer, file->nread) == -1)
-		{
-			sys_error("cp", "could not write to '%s'", argv[2]);
-			file_close(file);
-			return 0;
-		}
+		sys_error("cp", "could not write to '%s'", argv[2]);
+		close(fd);
+		file_close(file);
+		return 0;
+	}
+	if (r == -1)
+	{
+		close(fd);
+		file_close(file);
+		return 0;
 	}
 
 	if (close(fd) == -1)
@@ -250,6 +724,10 @@ cp_cmd(int argc, char *argv[])
 		file_close(file);
 		return 0;
 	}
+
+	if ((bad = file_bad_blocks(file)) > 0)
+		fprintf(stderr, "warning: %s: %" PRIu64 " unreadable blocks replaced with zeros\n", argv[1], bad);
+	file_close(file);
 	return 1;
 }
 
@@ -261,3 +739,189 @@ map_cmd(int argc, char *argv[])
 
 	return map_write(fs, argv[1]);
 }
+
+static int
+fsck_problem(void *arg, FSChainProblem *problem)
+{
+	char msg[160];
+
+	fs_fat_describe_problem(problem, msg, sizeof(msg));
+	printf("%s\n", msg);
+	return 1;
+}
+
+static int
+fsck_cmd(int argc, char *argv[])
+{
+	int crc_ok;
+	int problems;
+
+	if (argc != 1)
+	{
+		fprintf(stderr, "usage: fsck\n");
+		error("fsck", "bad arguments");
+		return 0;
+	}
+
+	if ((crc_ok = fs_fat_verify(fs)) < 0)
+		return 0;
+	if (crc_ok)
+		printf("FAT CRC 0x%08" PRIx32 " over %d bytes: ok\n", fs->fat_crc32_computed, fs->fat_crc_size);
+	else if (fs->fat_crc_size < 0)
+		printf("superblock claims %d used clusters, more than the FAT holds\n", fs->used_clusters);
+	else
+		printf("FAT CRC is 0x%08" PRIx32 ", superblock says 0x%08" PRIx32 "\n",
+				fs->fat_crc32_computed, (uint32_t)fs->fat_crc32);
+
+	if ((problems = fs_fat_check(fs, fsck_problem, 0)) < 0)
+		return 0;
+	printf("%d problem%s in FAT chains\n", problems, problems == 1? "" : "s");
+
+	if (!crc_ok || problems > 0)
+	{
+		error("fsck", "filesystem is damaged");
+		return 0;
+	}
+	return 1;
+}
+
+static int
+frag_cmd(int argc, char *argv[])
+{
+	int opt;
+	int all = 0;
+
+	while ((opt = getopt(argc, argv, "a")) != -1)
+	{
+		switch (opt)
+		{
+		case 'a':
+			all = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: frag [-a]\n");
+			error("frag", "bad arguments");
+			return 0;
+		}
+	}
+	if (optind != argc)
+	{
+		fprintf(stderr, "usage: frag [-a]\n");
+		error("frag", "bad arguments");
+		return 0;
+	}
+
+	return fs_frag(fs, all);
+}
+
+#define WHICH_MAX_OWNERS 16
+
+typedef enum {
+	WHICH_CLUSTER,
+	WHICH_BYTE,
+	WHICH_BLOCK,
+} WhichUnit;
+
+static int
+which_query(FSOwners *owners, char *arg, WhichUnit unit)
+{
+	FSOwner owner[WHICH_MAX_OWNERS];
+	uint64_t value;
+	uint64_t within = 0;
+	int64_t cluster;
+	char *end;
+	int n;
+	int i;
+
+	value = strtoull(arg, &end, 0);
+	if (end == arg || *end != '\0')
+	{
+		error("which", "bad number '%s'", arg);
+		return 0;
+	}
+
+	/* Bad block lists count in device blocks, which needn't be 512 bytes. */
+	if (unit == WHICH_BLOCK)
+		value *= blkio_block_size(fs->disk->dev);
+	if (unit == WHICH_CLUSTER)
+	{
+		cluster = value;
+	}
+	else
+	{
+		/* Cluster n starts at byte (n+1)*bytes_per_cluster. */
+		cluster = (int64_t)(value/fs->bytes_per_cluster) - 1;
+		within = value%fs->bytes_per_cluster;
+	}
+
+	if (cluster < 0)
+	{
+		printf("%s: filesystem metadata\n", arg);
+		return 1;
+	}
+	if (cluster > INT32_MAX || (n = fs_owners_lookup(owners, cluster, owner, WHICH_MAX_OWNERS)) == 0)
+	{
+		printf("%s: cluster %" PRId64 ": not in any file\n", arg, cluster);
+		return 1;
+	}
+	for (i = 0; i < n && i < WHICH_MAX_OWNERS; i++)
+		printf("%s: cluster %" PRId64 ": %s cluster %d, offset %" PRIu64 "\n",
+				arg, cluster, owner[i].path, owner[i].position, owner[i].offset+within);
+	if (n > WHICH_MAX_OWNERS)
+		printf("%s: cluster %" PRId64 ": %d more files\n", arg, cluster, n-WHICH_MAX_OWNERS);
+	return 1;
+}
+
+/*
+ * Bad block lists can be long, so the index is built once and the
+ * queries can be given on stdin, one per line.
+ */
+static int
+which_cmd(int argc, char *argv[])
+{
+	FSOwners *owners;
+	WhichUnit unit = WHICH_CLUSTER;
+	char line[80];
+	char *p;
+	int opt;
+	int r = 1;
+
+	while ((opt = getopt(argc, argv, "bB")) != -1)
+	{
+		switch (opt)
+		{
+		case 'b':
+			unit = WHICH_BYTE;
+			break;
+		case 'B':
+			unit = WHICH_BLOCK;
+			break;
+		default:
+			fprintf(stderr, "usage: which [-b|-B] [N...]\n");
+			error("which", "bad arguments");
+			return 0;
+		}
+	}
+
+	if ((owners = fs_owners_build(fs)) == 0)
+		return 0;
+
+	if (optind < argc)
+	{
+		for (; optind < argc && r; optind++)
+			r = which_query(owners, argv[optind], unit);
+	}
+	else
+	{
+		while (r && fgets(line, sizeof(line), stdin))
+		{
+			if ((p = strchr(line, '\n')) != 0)
+				*p = '\0';
+			if (line[0] != '\0')
+				r = which_query(owners, line, unit);
+		}
+	}
+
+	fs_owners_close(owners);
+	return r;
+}